@@ -0,0 +1,241 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bufpool.h"
+#include "common.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT (26)
+#endif
+
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+
+// Buffers are allocated in sizes being powers of two, so that a released
+// buffer fits the next request of a similar size. From the huge page size up,
+// they are multiples of it instead, so no huge page is wasted.
+#define BUFPOOL_MIN_CAPACITY (64 * 1024)
+#define BUFPOOL_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Every node keeps at most that many released buffers, taking at most that
+// many bytes in total. Buffers that don't fit are unmapped right away, so the
+// memory held by the idle pools is bounded.
+#define BUFPOOL_CACHED_PER_NODE (8)
+#define BUFPOOL_MAX_CACHED_BYTES (64 * 1024 * 1024)
+
+// Node masks passed to mbind are a single word.
+#define BUFPOOL_MAX_NODES (sizeof(unsigned long) * 8)
+
+// Buffer is the whole mapping, its size and node are kept aside, so that the
+// sizes asked for most often (powers of two) fill the mapping exactly.
+typedef struct {
+    uint8 *map;
+    size_t capacity;
+    int node;
+} bufpool_buffer;
+
+typedef struct {
+    bufpool_buffer cached[BUFPOOL_CACHED_PER_NODE];
+    size_t num_cached;
+    size_t cached_bytes; // Capacities of the cached buffers summed up.
+} bufpool_node;
+
+static bufpool_node *nodes = 0;
+static size_t num_nodes = 0;
+static int pool_flags = 0;
+
+// Buffers given out and not released yet. Only a few of them are alive at
+// once, so they are searched linearly, starting from the latest one.
+static bufpool_buffer *live = 0;
+static size_t num_live = 0;
+static size_t live_capacity = 0;
+
+// Reads the number of nodes from the sysfs, where possible nodes are listed
+// like "0" or "0-3". Machines without NUMA have a single node.
+static size_t read_num_nodes(void) {
+    FILE *possible = fopen("/sys/devices/system/node/possible", "r");
+    if (!possible)
+        return 1;
+
+    size_t retval = 1;
+    unsigned first, last;
+    int matched = fscanf(possible, "%u-%u", &first, &last);
+    if (matched == 2)
+        retval = last + 1;
+    else if (matched == 1)
+        retval = first + 1;
+
+    fclose(possible);
+    return (retval > BUFPOOL_MAX_NODES ? BUFPOOL_MAX_NODES : retval);
+}
+
+static int current_node(void) {
+    unsigned cpu, node;
+    if (num_nodes == 1 || syscall(SYS_getcpu, &cpu, &node, 0) == -1 ||
+        node >= num_nodes) {
+        return 0;
+    }
+
+    return (int)node;
+}
+
+static size_t capacity_for(size_t size) {
+    if (size > BUFPOOL_HUGE_PAGE_SIZE) {
+        return (size + BUFPOOL_HUGE_PAGE_SIZE - 1) /
+               BUFPOOL_HUGE_PAGE_SIZE * BUFPOOL_HUGE_PAGE_SIZE;
+    }
+
+    size_t capacity = BUFPOOL_MIN_CAPACITY;
+    while (capacity < size)
+        capacity *= 2;
+
+    return capacity;
+}
+
+// Maps [capacity] bytes whose pages will come from [node]. Big mappings are
+// aligned to the huge page, because only aligned ranges can use them.
+static uint8 *map_buffer(size_t capacity, int node) {
+    int huge = (capacity >= BUFPOOL_HUGE_PAGE_SIZE);
+    uint8 *map = MAP_FAILED;
+    if (huge && (pool_flags & BUFPOOL_HUGETLB)) {
+        // Fails if no huge pages are reserved, then we go on as usual.
+        map = mmap(0, capacity, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1,
+                   0);
+    }
+
+    if (map == MAP_FAILED) {
+        size_t extra = (huge ? BUFPOOL_HUGE_PAGE_SIZE : 0);
+        uint8 *raw = mmap(0, capacity + extra, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return 0;
+
+        map = raw;
+        if (huge) {
+            size_t misalignment = (size_t)raw % BUFPOOL_HUGE_PAGE_SIZE;
+            size_t head = (misalignment ? extra - misalignment : 0);
+            map = raw + head;
+            if (head > 0)
+                munmap(raw, head);
+            if (extra - head > 0)
+                munmap(map + capacity, extra - head);
+
+            // Not an error if transparent huge pages are disabled.
+            madvise(map, capacity, MADV_HUGEPAGE);
+        }
+    }
+
+    // Pages are not touched yet, so all of them will be placed on the node.
+    // Preferred, not bound, so that we can still run when the node is full.
+    // Kernel reads one bit less than maxnode says.
+    if (num_nodes > 1) {
+        unsigned long nodemask = 1ul << node;
+        syscall(SYS_mbind, map, capacity, MPOL_PREFERRED, &nodemask,
+                BUFPOOL_MAX_NODES + 1, 0);
+    }
+
+    return map;
+}
+
+// Remembers the buffer as given out. Returns 0 on success or -1 if malloc
+// failed.
+static int push_live(bufpool_buffer buffer) {
+    if (num_live == live_capacity) {
+        size_t new_capacity = (live_capacity ? live_capacity * 2 : 16);
+        bufpool_buffer *new_live =
+            realloc(live, new_capacity * sizeof(bufpool_buffer));
+        if (!new_live)
+            return -1;
+
+        live = new_live;
+        live_capacity = new_capacity;
+    }
+
+    live[num_live++] = buffer;
+    return 0;
+}
+
+int bufpool_init(int flags) {
+    pool_flags = flags;
+    if (nodes)
+        return 0;
+
+    size_t nodes_count = read_num_nodes();
+    bufpool_node *new_nodes = calloc(nodes_count, sizeof(bufpool_node));
+    if (!new_nodes) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    nodes = new_nodes;
+    num_nodes = nodes_count;
+    return 0;
+}
+
+void *bufpool_alloc(size_t size) {
+    if (!nodes && bufpool_init(0) == -1)
+        return 0;
+
+    size_t capacity = capacity_for(size);
+    int node = current_node();
+    bufpool_node *pool = &nodes[node];
+
+    bufpool_buffer buffer;
+    buffer.map = 0;
+    for (size_t i = 0; i != pool->num_cached; ++i) {
+        if (pool->cached[i].capacity == capacity) {
+            buffer = pool->cached[i];
+            pool->cached[i] = pool->cached[--pool->num_cached];
+            pool->cached_bytes -= capacity;
+            break;
+        }
+    }
+
+    if (!buffer.map) {
+        buffer.map = map_buffer(capacity, node);
+        buffer.capacity = capacity;
+        buffer.node = node;
+    }
+
+    if (!buffer.map || push_live(buffer) == -1) {
+        if (buffer.map)
+            munmap(buffer.map, buffer.capacity);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    return buffer.map;
+}
+
+void bufpool_release(void *buffer) {
+    if (!buffer)
+        return;
+
+    size_t i = num_live;
+    while (i > 0 && live[i - 1].map != buffer)
+        --i;
+
+    assert(i > 0);
+    bufpool_buffer released = live[i - 1];
+    live[i - 1] = live[--num_live];
+
+    bufpool_node *pool = &nodes[released.node];
+    if (pool->cached_bytes + released.capacity <= BUFPOOL_MAX_CACHED_BYTES &&
+        pool->num_cached < BUFPOOL_CACHED_PER_NODE) {
+        pool->cached[pool->num_cached++] = released;
+        pool->cached_bytes += released.capacity;
+        return;
+    }
+
+    munmap(released.map, released.capacity);
+}
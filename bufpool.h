@@ -0,0 +1,38 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+// Pools of the big buffers used on the data path (file chunks and frames).
+// Buffers are mapped with mmap instead of taken from malloc, so that:
+//  - buffers of 2MiB and more are backed by huge pages, transparent ones or,
+//    if asked for, explicit ones from the hugetlb pool, which cuts the number
+//    of TLB misses when the chunk is read or sent,
+//  - every NUMA node has its own pool, and the pages of its buffers are
+//    allocated on that node, so the program running on a node always gets
+//    the memory local to it, even when it has moved to another CPU since it
+//    freed the buffer.
+// Released buffers are kept for reuse, up to a fixed number of bytes per node,
+// so the page faults are paid once. Like the rest of the programs, pools are
+// not thread safe.
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Use explicit huge pages when there are any reserved. Transparent ones are
+// used otherwise.
+#define BUFPOOL_HUGETLB (1)
+
+// Prepares one pool for every NUMA node of the machine. Optional, pools with
+// no flags are prepared on the first allocation otherwise. Returns 0 on
+// success or -1 with errno set.
+int bufpool_init(int flags);
+
+// Returns the buffer of at least [size] bytes from the pool of the node the
+// program runs on, or 0 if it can't be allocated (errno is set to ENOMEM).
+void *bufpool_alloc(size_t size);
+
+// Gives the buffer back to the pool of the node it was allocated on. Passing 0
+// does nothing.
+void bufpool_release(void *buffer);
+
+#endif // BUFPOOL_H
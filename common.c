@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -81,6 +82,85 @@ int snd_total(int fd, uint8 *buffer, size_t count) {
     return 0;
 }
 
+int snd_total_with_fd(int sock, uint8 *buffer, size_t count, int fd) {
+    assert(count > 0);
+
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = count;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    // Descriptor goes with the first byte, the rest is sent normally.
+    ssize_t send_data = sendmsg(sock, &msg, 0);
+    if (send_data == -1)
+        return -1;
+
+    return snd_total(sock, buffer + send_data, count - send_data);
+}
+
+int rcv_total_with_fd(int sock, uint8 *buffer, size_t count, int *fd) {
+    assert(count > 0);
+    *fd = -1;
+
+    struct iovec iov;
+    iov.iov_base = buffer;
+    iov.iov_len = count;
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t bytes_red = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (bytes_red == -1)
+        return -1;
+
+    if (bytes_red == 0) {
+        errno = ESTRPIPE;
+        return -1;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+
+    if (rcv_total(sock, buffer + bytes_red, count - bytes_red) == -1) {
+        if (*fd != -1)
+            close(*fd);
+        *fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
 uint16 unaligned_load_int16be(uint8 *data) {
     uint16 retval = 0;
     retval += (((uint16)(*data++)) << 8);
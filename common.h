@@ -17,14 +17,50 @@ typedef double real64;
 // Protocol constants:
 #define PROT_REQ_FILELIST (1)
 #define PROT_REQ_FILECHUNK (2)
+#define PROT_REQ_FILECHUNK_LZ (3)
+#define PROT_REQ_DIRLIST (4)
+#define PROT_REQ_FILEPUT (5)
+#define PROT_REQ_FILEFD (6)
 
 #define PROT_RESP_FILELIST (1)
 #define PROT_RESP_FILECHUNK_ERROR (2)
 #define PROT_RESP_FILECHUNK_OK (3)
+#define PROT_RESP_FILECHUNK_LZ_OK (4)
+#define PROT_RESP_DIRLIST (5)
+#define PROT_RESP_DIRLIST_ERROR (6)
+#define PROT_RESP_FILEPUT_OK (7)
+#define PROT_RESP_FILEPUT_ERROR (8)
+#define PROT_RESP_FILEFD_OK (9)
+#define PROT_RESP_FILEFD_ERROR (10)
 
 #define FREQ_ERROR_ON_SUCH_FILE (1)
 #define FREQ_ERROR_OUT_OF_RANGE (2)
 #define FREQ_ERROR_ZERO_LEN (3)
+#define FREQ_ERROR_NOT_PERMITTED (4)
+#define FREQ_ERROR_WRITE_FAILED (5)
+
+// Files can be requested with a path relative to the served directory, with
+// components separated by '/'. Dirlist request is followed by 16bit length of
+// such path to the directory (0 for the served directory itself) and the path.
+// Response looks like the filelist response, but it lists subdirectories as
+// well, with '/' at the end of their names.
+
+// Fileput request has the same header as the filechunk request, and is
+// followed by the [addr_len] bytes that are written to the file starting at
+// [addr_from]. New files are created only when the whole request has been
+// written. Response is the 16bit code followed by the 32bit number of written
+// bytes or the refuse reason.
+
+// Filefd request is allowed only on the Unix domain socket. It is followed by
+// the 16bit length of the path and the path. The opened file descriptor is
+// passed along with the OK response, so the client reads the file directly.
+
+// Compressed chunks are sent in frames holding at most that many bytes of the
+// file. Every frame starts with two 32bit numbers: the length of the file data
+// and the length of the data that follows. If they are equal, the frame was not
+// compressed and it contains raw file data.
+#define LZ_FRAME_SIZE (64 * 1024)
+#define LZ_FRAME_HEADER_SIZE (8)
 
 // Default port for both programs.
 static char const *const default_port = "6543";
@@ -72,6 +108,16 @@ int rcv_total(int fd, uint8 *buffer, size_t count);
 // unexpetedly). In both cases errno is set.
 int snd_total(int fd, uint8 *buffer, size_t count);
 
+// Same as snd_total, but [fd] is passed to the other end of the Unix domain
+// socket along with the data (with SCM_RIGHTS). Returns 0 on sucess or -1 on
+// failure with errno set.
+int snd_total_with_fd(int sock, uint8 *buffer, size_t count, int fd);
+
+// Same as rcv_total, but also receives a file descriptor sent with
+// snd_total_with_fd. [fd] is set to -1 if no descriptor came with the
+// data. Returns 0 on sucess or -1 on failure with errno set.
+int rcv_total_with_fd(int sock, uint8 *buffer, size_t count, int *fd);
+
 // Im not entierly sure if they are needed, but I'm using them for
 // safetly. These are used to convert a string of bytes with random aligment to
 // the integers.
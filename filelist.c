@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "filelist.h"
+
+// 64bit FNV-1a.
+static uint64 filelist_hash(char const *name) {
+    uint64 retval = 14695981039346656037ULL;
+    for (; *name; ++name) {
+        retval ^= (uint8)(*name);
+        retval *= 1099511628211ULL;
+    }
+
+    return retval;
+}
+
+int filelist_init(filelist *self, char *data, size_t data_len) {
+    self->filenames = data;
+    self->names = 0;
+    self->num_files = 0;
+    self->hash_slots = 0;
+    self->hash_capacity = 0;
+
+    size_t names_capacity = 64;
+    self->names = malloc(names_capacity * sizeof(char *));
+    if (!self->names) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Empty list has no names, not a single empty one.
+    if (data_len == 0)
+        return 0;
+
+    // Because [data] has one more byte, last name can be terminated just like
+    // the others.
+    char *end = data + data_len;
+    *end++ = '|';
+
+    // memchr is vectorized, so this is much faster than checking every byte in
+    // a loop for long lists.
+    char *curr = data;
+    while (curr != end) {
+        char *next = memchr(curr, '|', end - curr);
+        assert(next); // There is always a '|' at the end.
+        *next = '\0';
+
+        if (self->num_files == names_capacity) {
+            names_capacity *= 2;
+            char **new_names =
+                realloc(self->names, names_capacity * sizeof(char *));
+            if (!new_names) {
+                errno = ENOMEM;
+                return -1;
+            }
+
+            self->names = new_names;
+        }
+
+        self->names[self->num_files++] = curr;
+        curr = next + 1;
+    }
+
+    return 0;
+}
+
+void filelist_free(filelist *self) {
+    free(self->filenames);
+    free(self->names);
+    free(self->hash_slots);
+}
+
+static int filelist_build_hash(filelist *self) {
+    // Keep the load factor at most 0.5, so that probe sequences are short.
+    size_t capacity = 16;
+    while (capacity < 2 * self->num_files)
+        capacity *= 2;
+
+    self->hash_slots = calloc(capacity, sizeof(uint32));
+    if (!self->hash_slots) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    self->hash_capacity = capacity;
+    for (size_t i = 0; i != self->num_files; ++i) {
+        size_t slot = filelist_hash(self->names[i]) & (capacity - 1);
+        while (self->hash_slots[slot] != 0)
+            slot = (slot + 1) & (capacity - 1);
+
+        self->hash_slots[slot] = (uint32)(i + 1);
+    }
+
+    return 0;
+}
+
+void filelist_remove_duplicates(filelist *self) {
+    // Linear probing finds the name inserted first, which has the lowest
+    // index, so only that one is kept.
+    size_t kept = 0;
+    for (size_t i = 0; i != self->num_files; ++i) {
+        if ((size_t)filelist_find(self, self->names[i]) == i)
+            self->names[kept++] = self->names[i];
+    }
+
+    // Indexes have changed, so the hash table is built again when needed.
+    self->num_files = kept;
+    free(self->hash_slots);
+    self->hash_slots = 0;
+    self->hash_capacity = 0;
+}
+
+ssize_t filelist_find(filelist *self, char const *name) {
+    if (!self->hash_slots)
+        CHECK(filelist_build_hash(self));
+
+    size_t mask = self->hash_capacity - 1;
+    size_t slot = filelist_hash(name) & mask;
+    while (self->hash_slots[slot] != 0) {
+        size_t idx = self->hash_slots[slot] - 1;
+        if (strcmp(self->names[idx], name) == 0)
+            return idx;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return -1;
+}
@@ -0,0 +1,39 @@
+#ifndef FILELIST_H
+#define FILELIST_H
+
+// List of the filenames received from the server. Names are indexed when the
+// list is parsed, so selecting a file by number is O(1), and a hash table
+// (built on the first lookup by name) makes selecting it by name O(1) too.
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "common.h"
+
+typedef struct {
+    char *filenames; // Names separated with zeros.
+    char **names;    // Pointers to the beginnings of the names in filenames.
+    size_t num_files;
+
+    // Open addressing hash table of name indexes increased by one, so that 0
+    // marks an empty slot. Capacity is always a power of two.
+    uint32 *hash_slots;
+    size_t hash_capacity;
+} filelist;
+
+// Takes the ownership of the malloc'ed [data] holding [data_len] bytes of names
+// separated with '|'. [data] has to be at least [data_len] + 1 bytes long. -1
+// is returned when malloc failes, otherwise 0.
+int filelist_init(filelist *self, char *data, size_t data_len);
+
+void filelist_free(filelist *self);
+
+// Removes every name that is already on the list under a lower index. Names
+// are merged this way when lists from many servers are concatenated.
+void filelist_remove_duplicates(filelist *self);
+
+// Returns the index of the file with the given name, or -1 if there is no such
+// file. Builds the hash table if it does not exist yet.
+ssize_t filelist_find(filelist *self, char const *name);
+
+#endif // FILELIST_H
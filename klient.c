@@ -1,58 +1,140 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "bufpool.h"
 #include "common.h"
 #include "exbuffer.h"
+#include "filelist.h"
+#include "lz.h"
+#include "shard.h"
+#include "trace.h"
 
 #define USAGE_MSG                                                              \
-    "netstore_client <nazwa-lub-adres-IP4-serwera> [<numer-portu-serwera>]"
+    "netstore_client [-z] [-b <plik-z-lista>] [-d <katalog>] "               \
+    "[-u <plik-lokalny>[:<nazwa-na-serwerze>]] "                              \
+    "(-U <sciezka-gniazda-lokalnego> | "                                      \
+    "<serwer>[:<port>][,<serwer>[:<port>]...] [<numer-portu-serwera>])"
 
 char const refuse_invalid_name[] = "Invalid file name.";
 char const refuse_invalid_address[] =
     "Invalid starting file address (out of range).";
 char const refuse_invalid_len[] = "Region has length 0.";
+char const refuse_not_permitted[] = "Server does not accept uploads.";
+char const refuse_write_failed[] = "Server could not write the file.";
+
+// Limits of the request pipeline in the batch mode.
+#define BATCH_MAX_INFLIGHT (32)
+#define BATCH_MAX_INFLIGHT_BYTES (16 * 1024)
+
+// Files are uploaded in requests of at most that many bytes. Files smaller
+// than that are created atomically by the server.
+#define UPLOAD_CHUNK_SIZE (1024 * 1024 * 1024)
 
 typedef struct {
     char const *host;
     char const *port;
+    int compress; // Ask the server to send the chunk compressed.
+    char const *manifest; // If set, run in batch mode reading this file.
+    char const *dir;      // If set, list this directory instead of the root.
+    char const *upload;   // If set, upload this file instead of downloading.
+    char const *local_path; // If set, connect to the local server over the
+                            // Unix domain socket instead of host and port.
 } client_input_data;
 
+// Single line of the batch manifest.
+typedef struct {
+    char *name;
+    uint32 addr_from;
+    uint32 addr_to;
+    trace_request trace; // Set when the request is sent.
+} batch_entry;
+
+// Requests sent to one server in the batch mode, whose responses have not been
+// received yet.
 typedef struct {
-    char *filenames;
-    size_t num_files;
-} filelist_response;
+    batch_entry inflight[BATCH_MAX_INFLIGHT];
+    size_t first;
+    size_t count;
+    size_t bytes;
+} batch_pipeline;
+
+// Connections to all servers the files are spread over. Every file is
+// requested from the server that owns it on the ring.
+typedef struct {
+    shard_ring ring;
+    int *socks;
+    size_t num_socks;
+} shard_connections;
 
 typedef struct {
     uint8 *data;
     size_t data_len;
     int32 error_code;
+    int compressed; // If set, data_len bytes follow in frames on the socket.
 } filechunk_response;
 
-void filelist_response_free(filelist_response *self) {
-    if (self->filenames)
-        free(self->filenames);
+void filechunk_response_free(filechunk_response *self) {
+    bufpool_release(self->data);
 }
 
-void filechunk_response_free(filechunk_response *self) {
-    if (self->data)
-        free(self->data);
+void batch_entry_free(batch_entry *self) {
+    if (self->name)
+        free(self->name);
 }
 
 static client_input_data parse_input(int argc, char **argv) {
     client_input_data retval;
-    if (argc < 2 || argc > 3)
+    retval.compress = 0;
+    retval.manifest = 0;
+    retval.dir = 0;
+    retval.upload = 0;
+    retval.local_path = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "zb:d:u:U:")) != -1) {
+        if (opt == 'z')
+            retval.compress = 1;
+        else if (opt == 'b')
+            retval.manifest = optarg;
+        else if (opt == 'd')
+            retval.dir = optarg;
+        else if (opt == 'u')
+            retval.upload = optarg;
+        else if (opt == 'U')
+            retval.local_path = optarg;
+        else
+            bad_usage(USAGE_MSG);
+    }
+
+    int positional = argc - optind;
+    if (retval.local_path) {
+        if (positional != 0)
+            bad_usage(USAGE_MSG);
+
+        retval.host = 0;
+        retval.port = 0;
+        return retval;
+    }
+
+    if (positional < 1 || positional > 2)
         bad_usage(USAGE_MSG);
 
-    retval.host = argv[1];
-    retval.port = (argc == 3 ? argv[2] : default_port);
+    retval.host = argv[optind];
+    retval.port = (positional == 2 ? argv[optind + 1] : default_port);
     return retval;
 }
 
@@ -61,12 +143,18 @@ static inline char const *file_refuse_tostr(int32 refuse_code) {
         return refuse_invalid_name;
     else if (refuse_code == FREQ_ERROR_OUT_OF_RANGE)
         return refuse_invalid_address;
+    else if (refuse_code == FREQ_ERROR_NOT_PERMITTED)
+        return refuse_not_permitted;
+    else if (refuse_code == FREQ_ERROR_WRITE_FAILED)
+        return refuse_write_failed;
     else // FREQ_ERROR_ZERO_LEN
         return refuse_invalid_len;
 }
 
-static void write_to_tmp_file_at_offset(char const *filename, size_t offset,
-                                        uint8 *data, size_t len) {
+// Opens (or creates) the file with the given name in the output directory. Path
+// of the file is written to [path_combined] which has to be at least PATH_MAX
+// bytes long.
+static FILE *open_tmp_file(char const *filename, char *path_combined) {
     int mkdir_result = mkdir("./tmp", 0777);
     if (mkdir_result == -1 && errno != EEXIST) {
         // If makedir returned other error than one indicating that dir exists,
@@ -76,11 +164,26 @@ static void write_to_tmp_file_at_offset(char const *filename, size_t offset,
 
     char const outputdir[] = "./tmp";
     size_t outputdir_len = sizeof(outputdir) - 1;
-    char path_combined[outputdir_len + 1 + strlen(filename) + 1];
+    if (outputdir_len + 1 + strlen(filename) + 1 > PATH_MAX) {
+        errno = ENAMETOOLONG;
+        FAILWITH_ERRNO();
+    }
+
     strcpy(path_combined, outputdir);
     strcpy(&path_combined[outputdir_len], "/");
     strcpy(&path_combined[outputdir_len + 1], filename);
 
+    // Files from subdirectories of the server go to the same subdirectories
+    // of the output directory.
+    for (char *slash = strchr(&path_combined[outputdir_len + 1], '/'); slash;
+         slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir_result = mkdir(path_combined, 0777);
+        *slash = '/';
+        if (mkdir_result == -1 && errno != EEXIST)
+            FAILWITH_ERRNO();
+    }
+
     FILE *fileptr = fopen(path_combined, "r+");
     if (!fileptr)
         fileptr = fopen(path_combined, "w+");
@@ -89,14 +192,78 @@ static void write_to_tmp_file_at_offset(char const *filename, size_t offset,
     if (!fileptr)
         FAILWITH_ERRNO();
 
+    return fileptr;
+}
+
+static void write_to_tmp_file_at_offset(char const *filename, size_t offset,
+                                        uint8 *data, size_t len) {
+    TRACE_BEGIN(write_start);
+    char path_combined[PATH_MAX];
+    FILE *fileptr = open_tmp_file(filename, path_combined);
+
     CHECK(fseek(fileptr, offset, SEEK_SET));
     CHECK(fwrite(data, 1, len, fileptr));
     CHECK(fclose(fileptr));
+    TRACE_END(write_start, "write_to_tmp_file_at_offset");
 
     fprintf(stderr, "Sucesfully wrote %lu bytes to file %s\n", len,
             path_combined);
 }
 
+// Receives the frames of the compressed chunk and writes them to the output
+// file as they come, so the whole chunk is never held in memory.
+static void rcv_lz_frames_to_tmp_file(int msg_sock, char const *filename,
+                                      size_t offset, size_t len) {
+    TRACE_BEGIN(rcv_start);
+    char path_combined[PATH_MAX];
+    FILE *fileptr = open_tmp_file(filename, path_combined);
+    CHECK(fseek(fileptr, offset, SEEK_SET));
+
+    uint8 *raw = bufpool_alloc(LZ_FRAME_SIZE);
+    uint8 *payload = bufpool_alloc(LZ_FRAME_SIZE);
+    if (!raw || !payload) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    size_t remained = len;
+    size_t total_compressed = 0;
+    while (remained > 0) {
+        uint8 frame_header[LZ_FRAME_HEADER_SIZE];
+        CHECK(rcv_total(msg_sock, frame_header, LZ_FRAME_HEADER_SIZE));
+
+        uint32 raw_len = unaligned_load_int32be(frame_header);
+        uint32 payload_len = unaligned_load_int32be(frame_header + 4);
+        if (raw_len == 0 || raw_len > LZ_FRAME_SIZE || raw_len > remained ||
+            payload_len > raw_len) {
+            fprintf(stderr, "ERROR: Unexpeted response from server\n");
+            exit(1);
+        }
+
+        if (payload_len == raw_len) {
+            CHECK(rcv_total(msg_sock, raw, raw_len));
+        }
+        else {
+            CHECK(rcv_total(msg_sock, payload, payload_len));
+            CHECK(lz_decompress(payload, payload_len, raw, raw_len));
+        }
+
+        if (fwrite(raw, 1, raw_len, fileptr) != raw_len)
+            FAILWITH_ERRNO();
+
+        remained -= raw_len;
+        total_compressed += payload_len;
+    }
+
+    bufpool_release(raw);
+    bufpool_release(payload);
+    CHECK(fclose(fileptr));
+    TRACE_END(rcv_start, "rcv_lz_frames_to_tmp_file");
+
+    fprintf(stderr, "Sucesfully wrote %lu bytes (%lu compressed) to file %s\n",
+            len, total_compressed, path_combined);
+}
+
 // This will exit if user-inserted values are invalid.
 static inline void sanitize_selected_file_input(int32 filenum, int32 addr_from,
                                                 int32 addr_to,
@@ -115,12 +282,18 @@ static inline void sanitize_selected_file_input(int32 filenum, int32 addr_from,
     }
 }
 
-static void rcv_filelist(int msg_sock, filelist_response *req) {
+// Receives the response for either filelist or dirlist request and appends
+// the names to [names], separated with '|'. Returns 0 on success or -1 if the
+// server does not have the requested directory.
+static int rcv_filelist(int msg_sock, exbuffer *names) {
     uint8 header_buf[6];
     CHECK(rcv_total(msg_sock, (uint8 *)header_buf, 6));
 
     int16 msg_type = unaligned_load_int16be(header_buf);
-    if (msg_type != PROT_RESP_FILELIST) {
+    if (msg_type == PROT_RESP_DIRLIST_ERROR) {
+        return -1;
+    }
+    else if (msg_type != PROT_RESP_FILELIST && msg_type != PROT_RESP_DIRLIST) {
         fprintf(stderr, "ERROR: Unexpeted response from server\n");
         exit(1);
     }
@@ -128,54 +301,46 @@ static void rcv_filelist(int msg_sock, filelist_response *req) {
     fprintf(stderr, "Received filelist from the server\n");
 
     int32 dirnames_size = unaligned_load_int32be(header_buf + 2);
-    if (dirnames_size == 0) {
-        fprintf(stderr,
-                "Directory contains no files. There is nothing to do\n");
-        exit(0);
-    }
+    if (dirnames_size == 0)
+        return 0;
 
-    char *names = malloc(dirnames_size + 1);
-    if (!names) {
-        errno = ENOMEM;
-        FAILWITH_ERRNO();
+    if (names->size > 0) {
+        char separator[] = "|";
+        CHECK(exbuffer_append(names, (uint8 *)separator, 1));
     }
 
-    CHECK(rcv_total(msg_sock, (uint8 *)names, dirnames_size));
-    char *curr = names;
-    char *next = names;
-    char *end = names + dirnames_size;
-    int32 idx = 0;
-
-    // Because we've allocated one more byte for [names].
-    *end++ = '|';
-
-    // Now we replace all '|' with zeros, so filenames are null separated.
-    while ((curr = next) != end) {
-        while (*next != '|')
-            ++next;
-        *next++ = '\0';
-        idx++;
-    }
-
-    req->filenames = names;
-    req->num_files = idx;
+    CHECK(exbuffer_reserve(names, names->size + dirnames_size));
+    CHECK(rcv_total(msg_sock, names->data + names->size, dirnames_size));
+    names->size += dirnames_size;
+    return 0;
 }
 
 static void rvc_filechunk(int msg_sock, filechunk_response *req) {
     uint8 rcv_header[6];
+    TRACE_BEGIN(wait_start);
     CHECK(rcv_total(msg_sock, rcv_header, 6));
+    TRACE_END(wait_start, "rcv_response");
 
     int16 code = unaligned_load_int16be(rcv_header);
     int32 following = unaligned_load_int32be(rcv_header + 2);
     fprintf(stderr, "Received response from the server\n");
 
+    req->compressed = 0;
     if (code == PROT_RESP_FILECHUNK_ERROR) {
         req->data = 0;
         req->data_len = 0;
         req->error_code = following;
     }
+    else if (code == PROT_RESP_FILECHUNK_LZ_OK) {
+        // Frames are left on the socket, because they are written to the file
+        // one by one.
+        req->data = 0;
+        req->data_len = following;
+        req->error_code = 0;
+        req->compressed = 1;
+    }
     else if (code == PROT_RESP_FILECHUNK_OK) {
-        req->data = malloc(following);
+        req->data = bufpool_alloc(following);
         if (!req->data) {
             errno = ENOMEM;
             FAILWITH_ERRNO();
@@ -183,7 +348,9 @@ static void rvc_filechunk(int msg_sock, filechunk_response *req) {
 
         req->data_len = following;
         req->error_code = 0;
+        TRACE_BEGIN(rcv_start);
         CHECK(rcv_total(msg_sock, req->data, following));
+        TRACE_END(rcv_start, "rcv_total");
     }
     else {
         fprintf(stderr, "ERROR: Unexpeted response from server\n");
@@ -193,17 +360,35 @@ static void rvc_filechunk(int msg_sock, filechunk_response *req) {
 
 static void snd_filelist_response(int msg_sock) {
     int16 msg_get = htons(PROT_REQ_FILELIST);
+    trace_next_request(msg_sock);
     CHECK(write(msg_sock, &msg_get, 2));
 }
 
-static void snd_file_request(int msg_sock, uint32 addr_from, uint32 addr_to,
-                             char const *selected_name) {
+static void snd_dirlist_request(int msg_sock, char const *path) {
+    uint16 path_len = (uint16)strlen(path);
+    uint16 msg_get = htons(PROT_REQ_DIRLIST);
+    uint16 msg_path_len = htons(path_len);
+
+    exbuffer ebuf;
+    CHECK(exbuffer_init(&ebuf));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)(&msg_get), 2));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)(&msg_path_len), 2));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)path, path_len));
+    trace_next_request(msg_sock);
+    CHECK(snd_total(msg_sock, ebuf.data, ebuf.size));
+    exbuffer_free(&ebuf);
+}
+
+// Returns the trace id of the sent request.
+static trace_request snd_file_request(int msg_sock, int16 request_code,
+                                      uint32 addr_from, uint32 addr_to,
+                                      char const *selected_name) {
     uint16 choosen_name_len = (uint16)strlen(selected_name);
 
     size_t total_msg_size = 2 + 4 + 4 + 2 + choosen_name_len;
 
     // Prepare and byteswap values to send.
-    uint32 msg_request_num = htons(PROT_REQ_FILECHUNK);
+    uint32 msg_request_num = htons(request_code);
     uint32 msg_addr_from = htonl(addr_from);
     uint32 msg_addr_len = htonl(addr_to - addr_from);
     uint16 msg_str_len = htons(choosen_name_len);
@@ -217,14 +402,18 @@ static void snd_file_request(int msg_sock, uint32 addr_from, uint32 addr_to,
     CHECK(exbuffer_append(&ebuf, (uint8 *)selected_name, choosen_name_len));
 
     assert(ebuf.size == total_msg_size);
-    CHECK(write(msg_sock, ebuf.data, ebuf.size));
+    trace_request retval = trace_next_request(msg_sock);
+    TRACE_BEGIN(snd_start);
+    CHECK(snd_total(msg_sock, ebuf.data, ebuf.size));
+    TRACE_END(snd_start, "snd_total");
     exbuffer_free(&ebuf);
 
     fprintf(stderr, "Request for file %s addr: %u - %u has been sent\n",
             selected_name, addr_from, addr_to);
+    return retval;
 }
 
-static int init_and_connect(client_input_data *idata) {
+static int init_and_connect(char const *host, char const *port) {
     // 'converting' host/port in string to struct addrinfo
     struct addrinfo addr_hints;
     struct addrinfo *addr_result;
@@ -232,7 +421,11 @@ static int init_and_connect(client_input_data *idata) {
     addr_hints.ai_family = AF_INET; // IPv4
     addr_hints.ai_socktype = SOCK_STREAM;
     addr_hints.ai_protocol = IPPROTO_TCP;
-    if (getaddrinfo(idata->host, idata->port, &addr_hints, &addr_result) != 0) {
+    TRACE_BEGIN(getaddrinfo_start);
+    int getaddrinfo_result =
+        getaddrinfo(host, port, &addr_hints, &addr_result);
+    uint64 getaddrinfo_end = (TRACE_ENABLED ? trace_now() : 0);
+    if (getaddrinfo_result != 0) {
         // With some reason, getaddrinfo does not set errno, so we have to set
         // it manually before exitting with an error.
         errno = EFAULT;
@@ -244,71 +437,615 @@ static int init_and_connect(client_input_data *idata) {
                             addr_result->ai_protocol));
 
     // connect socket to the server
+    TRACE_BEGIN(connect_start);
     CHECK(connect(msg_sock, addr_result->ai_addr, addr_result->ai_addrlen));
     freeaddrinfo(addr_result);
 
+    // Port of the connection is known only now, so the phases are emitted
+    // after the fact.
+    trace_connection(msg_sock, 0);
+    if (TRACE_ENABLED) {
+        trace_phase_at("getaddrinfo", getaddrinfo_start, getaddrinfo_end);
+        trace_phase("connect", connect_start);
+    }
+
     fprintf(stderr, "Connecting succeeded\n");
     return msg_sock;
 }
 
+// Receives the response for the chunk request and writes the chunk to the
+// output file. Returns 0 on success or refuse code if the server has refused.
+static int32 rcv_filechunk_to_tmp_file(int msg_sock, char const *name,
+                                       uint32 addr_from) {
+    filechunk_response filechunk;
+    rvc_filechunk(msg_sock, &filechunk);
+
+    // If error code was set, server has refused.
+    if (filechunk.error_code) {
+        printf("Server refused %s, reason: %s\n", name,
+               file_refuse_tostr(filechunk.error_code));
+    }
+    else if (filechunk.compressed) {
+        rcv_lz_frames_to_tmp_file(msg_sock, name, addr_from,
+                                  filechunk.data_len);
+    }
+    else {
+        write_to_tmp_file_at_offset(name, addr_from, filechunk.data,
+                                    filechunk.data_len);
+    }
+
+    int32 retval = filechunk.error_code;
+    filechunk_response_free(&filechunk);
+    return retval;
+}
+
+// Copies the [len] bytes at [offset] of the file [in_fd] to the output file.
+// copy_file_range lets the kernel copy the data (or just share the blocks)
+// without going through the user space, if that is not possible, we copy it
+// with pread and fwrite.
+static void copy_to_tmp_file(int in_fd, off_t offset, char const *filename,
+                             size_t len) {
+    char path_combined[PATH_MAX];
+    FILE *fileptr = open_tmp_file(filename, path_combined);
+    int out_fd = fileno(fileptr);
+
+    off_t out_offset = offset;
+    size_t remained = len;
+    while (remained > 0) {
+        ssize_t copied =
+            copy_file_range(in_fd, &offset, out_fd, &out_offset, remained, 0);
+        if (copied == -1 && (errno == EXDEV || errno == EINVAL ||
+                             errno == ENOSYS || errno == EOPNOTSUPP)) {
+            break;
+        }
+        else if (copied == -1) {
+            FAILWITH_ERRNO();
+        }
+        else if (copied == 0) {
+            errno = ESTRPIPE; // File has shrunk in the meantime.
+            FAILWITH_ERRNO();
+        }
+
+        remained -= copied;
+    }
+
+    if (remained > 0) {
+        uint8 *buffer = bufpool_alloc(LZ_FRAME_SIZE);
+        if (!buffer) {
+            errno = ENOMEM;
+            FAILWITH_ERRNO();
+        }
+
+        CHECK(fseek(fileptr, out_offset, SEEK_SET));
+        while (remained > 0) {
+            size_t part = (remained < LZ_FRAME_SIZE ? remained : LZ_FRAME_SIZE);
+            ssize_t red = pread(in_fd, buffer, part, offset);
+            if (red <= 0) {
+                if (red == 0)
+                    errno = ESTRPIPE;
+                FAILWITH_ERRNO();
+            }
+
+            if (fwrite(buffer, 1, red, fileptr) != (size_t)red)
+                FAILWITH_ERRNO();
+
+            offset += red;
+            remained -= red;
+        }
+
+        bufpool_release(buffer);
+    }
+
+    CHECK(fclose(fileptr));
+    fprintf(stderr, "Sucesfully copied %lu bytes to file %s\n", len,
+            path_combined);
+}
+
+// Asks the local server for the descriptor of the file and copies the chunk
+// from it directly, so the data does not go through the socket at all. Range
+// is checked the same way the server checks it. Returns 0 on success or refuse
+// code if the chunk can't be downloaded.
+static int32 fetch_local_chunk(int msg_sock, char const *name,
+                               uint32 addr_from, uint32 addr_to) {
+    uint16 name_len = (uint16)strlen(name);
+    uint16 msg_get = htons(PROT_REQ_FILEFD);
+    uint16 msg_name_len = htons(name_len);
+
+    exbuffer ebuf;
+    CHECK(exbuffer_init(&ebuf));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)(&msg_get), 2));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)(&msg_name_len), 2));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)name, name_len));
+    trace_next_request(msg_sock);
+    CHECK(snd_total(msg_sock, ebuf.data, ebuf.size));
+    exbuffer_free(&ebuf);
+
+    uint8 rcv_header[6];
+    int fd;
+    TRACE_BEGIN(wait_start);
+    CHECK(rcv_total_with_fd(msg_sock, rcv_header, 6, &fd));
+    TRACE_END(wait_start, "rcv_response");
+
+    int16 code = unaligned_load_int16be(rcv_header);
+    int32 retval = 0;
+    if (code == PROT_RESP_FILEFD_ERROR) {
+        retval = unaligned_load_int32be(rcv_header + 2);
+    }
+    else if (code != PROT_RESP_FILEFD_OK || fd == -1) {
+        fprintf(stderr, "ERROR: Unexpeted response from server\n");
+        exit(1);
+    }
+    else {
+        struct stat filestat;
+        CHECK(fstat(fd, &filestat));
+        if (addr_to == addr_from) {
+            retval = FREQ_ERROR_ZERO_LEN;
+        }
+        else if (addr_from >= (size_t)filestat.st_size) {
+            retval = FREQ_ERROR_OUT_OF_RANGE;
+        }
+        else {
+            size_t len = addr_to - addr_from;
+            if (len > (size_t)filestat.st_size - addr_from)
+                len = filestat.st_size - addr_from;
+
+            TRACE_BEGIN(copy_start);
+            copy_to_tmp_file(fd, addr_from, name, len);
+            TRACE_END(copy_start, "copy_to_tmp_file");
+        }
+    }
+
+    if (fd != -1)
+        CHECK(close(fd));
+
+    if (retval != 0) {
+        printf("Server refused %s, reason: %s\n", name,
+               file_refuse_tostr(retval));
+    }
+
+    return retval;
+}
+
+// Parses the manifest line in format: <name> <addr-from> <addr-to>. Name can
+// contain spaces, so addresses are taken from the end of the line. Returns 0 on
+// success, 1 if the line is empty or is a comment and -1 if it is malformed.
+static int parse_manifest_line(char *line, batch_entry *entry) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#')
+        return 1;
+
+    char *to_str = strrchr(line, ' ');
+    if (!to_str)
+        return -1;
+    *to_str++ = '\0';
+
+    char *from_str = strrchr(line, ' ');
+    if (!from_str || from_str == line)
+        return -1;
+    *from_str++ = '\0';
+
+    char *from_end;
+    char *to_end;
+    errno = 0;
+    unsigned long addr_from = strtoul(from_str, &from_end, 10);
+    unsigned long addr_to = strtoul(to_str, &to_end, 10);
+    if (errno != 0 || *from_str == '\0' || *from_end != '\0' ||
+        *to_str == '\0' || *to_end != '\0' || addr_from > UINT32_MAX ||
+        addr_to > UINT32_MAX || addr_to < addr_from) {
+        return -1;
+    }
+
+    entry->name = strdup(line);
+    if (!entry->name) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    entry->addr_from = addr_from;
+    entry->addr_to = addr_to;
+    return 0;
+}
+
+// Returns the socket of the server that owns the file with the given name.
+static int owner_sock(shard_connections const *conns, char const *name) {
+    if (conns->num_socks == 1)
+        return conns->socks[0];
+
+    return conns->socks[shard_ring_owner(&conns->ring, name)];
+}
+
+// Receives the response for the oldest request in the pipeline.
+static void batch_pipeline_pop(batch_pipeline *self, int msg_sock,
+                               size_t *total_ok, size_t *total_refused) {
+    batch_entry *oldest = &self->inflight[self->first];
+    trace_set_request(oldest->trace);
+    if (rcv_filechunk_to_tmp_file(msg_sock, oldest->name, oldest->addr_from) ==
+        0) {
+        ++*total_ok;
+    }
+    else {
+        ++*total_refused;
+    }
+
+    self->bytes -= 12 + strlen(oldest->name);
+    batch_entry_free(oldest);
+    self->first = (self->first + 1) % BATCH_MAX_INFLIGHT;
+    --self->count;
+}
+
+// Downloads every chunk listed in the manifest, every one from the server
+// that owns it, over a single connection per server. Up to
+// BATCH_MAX_INFLIGHT requests are sent to a server before its oldest response
+// is read, so the server does not wait for the client between requests. Number
+// of bytes of requests in flight is limited as well, so that neither side can
+// block on a full socket buffer while the other one is also writing.
+static void run_batch(shard_connections *conns, char const *manifest_path,
+                      int16 request_code, int local) {
+    FILE *manifest = fopen(manifest_path, "r");
+    if (!manifest)
+        FAILWITH_ERRNO();
+
+    batch_pipeline *pipelines =
+        calloc(conns->num_socks, sizeof(batch_pipeline));
+    if (!pipelines) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    size_t total_ok = 0;
+    size_t total_refused = 0;
+
+    char *line = 0;
+    size_t line_cap = 0;
+    size_t linum = 0;
+    while (getline(&line, &line_cap, manifest) != -1) {
+        batch_entry entry;
+        ++linum;
+        int parse_result = parse_manifest_line(line, &entry);
+        if (parse_result == -1) {
+            fprintf(stderr, "ERROR: Malformed manifest line %lu\n", linum);
+            exit(1);
+        }
+        else if (parse_result == 1) {
+            continue;
+        }
+
+        // Local chunks are copied without any requests in flight.
+        if (local) {
+            if (fetch_local_chunk(conns->socks[0], entry.name, entry.addr_from,
+                                  entry.addr_to) == 0) {
+                ++total_ok;
+            }
+            else {
+                ++total_refused;
+            }
+
+            batch_entry_free(&entry);
+            continue;
+        }
+
+        size_t server = (conns->num_socks == 1
+                             ? 0
+                             : shard_ring_owner(&conns->ring, entry.name));
+        int msg_sock = conns->socks[server];
+        batch_pipeline *pipeline = &pipelines[server];
+        size_t entry_bytes = 12 + strlen(entry.name);
+
+        // Make room for the new request.
+        while (pipeline->count > 0 &&
+               (pipeline->count == BATCH_MAX_INFLIGHT ||
+                pipeline->bytes + entry_bytes > BATCH_MAX_INFLIGHT_BYTES)) {
+            batch_pipeline_pop(pipeline, msg_sock, &total_ok, &total_refused);
+        }
+
+        entry.trace = snd_file_request(msg_sock, request_code,
+                                       entry.addr_from, entry.addr_to,
+                                       entry.name);
+        pipeline->inflight[(pipeline->first + pipeline->count) %
+                           BATCH_MAX_INFLIGHT] = entry;
+        ++pipeline->count;
+        pipeline->bytes += entry_bytes;
+    }
+
+    // Drain the pipelines at the end.
+    for (size_t i = 0; i != conns->num_socks; ++i) {
+        while (pipelines[i].count > 0) {
+            batch_pipeline_pop(&pipelines[i], conns->socks[i], &total_ok,
+                               &total_refused);
+        }
+    }
+
+    free(pipelines);
+    free(line);
+    fclose(manifest);
+
+    printf("Batch finished: %lu chunks downloaded, %lu refused\n", total_ok,
+           total_refused);
+}
+
+static int init_and_connect_local(client_input_data *idata) {
+    struct sockaddr_un server_address;
+    if (strlen(idata->local_path) >= sizeof(server_address.sun_path)) {
+        errno = ENAMETOOLONG;
+        FAILWITH_ERRNO();
+    }
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sun_family = AF_UNIX;
+    strcpy(server_address.sun_path, idata->local_path);
+
+    int msg_sock;
+    CHECK(msg_sock = socket(AF_UNIX, SOCK_STREAM, 0));
+    CHECK(connect(msg_sock, (struct sockaddr *)&server_address,
+                  sizeof(server_address)));
+    trace_connection(msg_sock, 0);
+
+    fprintf(stderr, "Connecting succeeded\n");
+    return msg_sock;
+}
+
+// Connects to all servers given in the input data, or only to the local one.
+static void connect_all(client_input_data *idata, shard_connections *conns) {
+    memset(&conns->ring, 0, sizeof(conns->ring));
+    if (idata->local_path) {
+        fprintf(stderr, "Input: local socket: %s\n", idata->local_path);
+        conns->num_socks = 1;
+    }
+    else {
+        if (shard_ring_init(&conns->ring, idata->host, idata->port) == -1)
+            bad_usage(USAGE_MSG);
+
+        conns->num_socks = conns->ring.num_servers;
+    }
+
+    conns->socks = malloc(conns->num_socks * sizeof(int));
+    if (!conns->socks) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    if (idata->local_path) {
+        conns->socks[0] = init_and_connect_local(idata);
+        return;
+    }
+
+    for (size_t i = 0; i != conns->num_socks; ++i) {
+        shard_server *server = &conns->ring.servers[i];
+        fprintf(stderr, "Input: host: %s, port: %s\n", server->host,
+                server->port);
+        conns->socks[i] = init_and_connect(server->host, server->port);
+    }
+}
+
+static void close_all(shard_connections *conns) {
+    for (size_t i = 0; i != conns->num_socks; ++i)
+        CHECK(close(conns->socks[i]));
+
+    free(conns->socks);
+    shard_ring_free(&conns->ring);
+}
+
+// Uploads the local file given as <local-path>[:<remote-path>] to the server
+// that owns it. When remote path is not given, the file is stored under its
+// local name. Data is sent with sendfile, so it is not copied through the user
+// space. The last request has no data, it makes the server cut the remote file
+// at the size of the local one, so that a longer file is replaced as a whole.
+// All requests are sent before any response is read, as responses are too
+// small to block the server.
+static void run_upload(shard_connections *conns, char const *upload_spec) {
+    char *local_path = strdup(upload_spec);
+    if (!local_path) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    char *remote_path = strrchr(local_path, ':');
+    if (remote_path) {
+        *remote_path++ = '\0';
+    }
+    else {
+        remote_path = strrchr(local_path, '/');
+        remote_path = (remote_path ? remote_path + 1 : local_path);
+    }
+
+    int msg_sock = owner_sock(conns, remote_path);
+    int fd = open(local_path, O_RDONLY);
+    if (fd == -1)
+        FAILWITH_ERRNO();
+
+    struct stat filestat;
+    CHECK(fstat(fd, &filestat));
+    if (filestat.st_size == 0 || filestat.st_size > UINT32_MAX) {
+        fprintf(stderr, "ERROR: File has to be from 1 byte to 4GiB long\n");
+        exit(1);
+    }
+
+    size_t file_size = filestat.st_size;
+    size_t num_requests = 0;
+    for (size_t offset = 0; offset < file_size; offset += UPLOAD_CHUNK_SIZE) {
+        size_t len = file_size - offset;
+        if (len > UPLOAD_CHUNK_SIZE)
+            len = UPLOAD_CHUNK_SIZE;
+
+        snd_file_request(msg_sock, PROT_REQ_FILEPUT, offset, offset + len,
+                         remote_path);
+
+        TRACE_BEGIN(sendfile_start);
+        off_t file_offset = offset;
+        size_t remained = len;
+        while (remained > 0) {
+            ssize_t sent = sendfile(msg_sock, fd, &file_offset, remained);
+            if (sent == -1)
+                FAILWITH_ERRNO();
+
+            if (sent == 0) {
+                fprintf(stderr, "ERROR: File has shrunk while being sent\n");
+                exit(1);
+            }
+
+            remained -= sent;
+        }
+        TRACE_END(sendfile_start, "sendfile");
+
+        ++num_requests;
+    }
+
+    CHECK(close(fd));
+    snd_file_request(msg_sock, PROT_REQ_FILEPUT, file_size, file_size,
+                     remote_path);
+    ++num_requests;
+
+    size_t total_written = 0;
+    for (size_t i = 0; i != num_requests; ++i) {
+        uint8 rcv_header[6];
+        CHECK(rcv_total(msg_sock, rcv_header, 6));
+
+        int16 code = unaligned_load_int16be(rcv_header);
+        int32 following = unaligned_load_int32be(rcv_header + 2);
+        if (code == PROT_RESP_FILEPUT_ERROR) {
+            printf("Server refused %s, reason: %s\n", remote_path,
+                   file_refuse_tostr(following));
+            exit(1);
+        }
+        else if (code != PROT_RESP_FILEPUT_OK) {
+            fprintf(stderr, "ERROR: Unexpeted response from server\n");
+            exit(1);
+        }
+
+        total_written += (uint32)following;
+    }
+
+    printf("Uploaded %lu bytes of %s as %s\n", total_written, local_path,
+           remote_path);
+    free(local_path);
+}
+
 int main(int argc, char **argv) {
     client_input_data idata = parse_input(argc, argv);
-    fprintf(stderr, "Input: host: %s, port: %s\n", idata.host, idata.port);
-    int msg_sock = init_and_connect(&idata);
+    trace_init("netstore-client");
+    CHECK(bufpool_init(0));
+    shard_connections conns;
+    connect_all(&idata, &conns);
+    int16 request_code =
+        (idata.compress ? PROT_REQ_FILECHUNK_LZ : PROT_REQ_FILECHUNK);
 
-    snd_filelist_response(msg_sock);
+    if (idata.upload) {
+        run_upload(&conns, idata.upload);
+        close_all(&conns);
+        return 0;
+    }
 
-    filelist_response filelist;
-    rcv_filelist(msg_sock, &filelist);
+    // Batch mode requests files by name, so the filelist is not needed.
+    if (idata.manifest) {
+        run_batch(&conns, idata.manifest, request_code, idata.local_path != 0);
+        close_all(&conns);
+        return 0;
+    }
 
-    printf("Directory contains %lu files:\n", filelist.num_files);
-    char const *curname = filelist.filenames;
-    for (size_t i = 0; i < filelist.num_files; ++i) {
-        printf("%lu. %s\n", i, curname);
-        curname = strchr(curname, '\0');
-        assert(curname); // We know how many zero is there, so we must succeed.
-        curname++;
+    // Every server is asked for its list before any response is read, and the
+    // lists are merged.
+    for (size_t i = 0; i != conns.num_socks; ++i) {
+        if (idata.dir)
+            snd_dirlist_request(conns.socks[i], idata.dir);
+        else
+            snd_filelist_response(conns.socks[i]);
     }
 
+    exbuffer names;
+    CHECK(exbuffer_init(&names));
+    size_t num_found = 0;
+    for (size_t i = 0; i != conns.num_socks; ++i)
+        num_found += (rcv_filelist(conns.socks[i], &names) == 0);
+
+    if (num_found == 0) {
+        fprintf(stderr, "ERROR: There is no such directory on the server\n");
+        exit(1);
+    }
+
+    // Names are given to the filelist, which needs one more byte.
+    filelist list;
+    CHECK(exbuffer_reserve(&names, names.size + 1));
+    CHECK(filelist_init(&list, (char *)names.data, names.size));
+    if (conns.num_socks > 1)
+        filelist_remove_duplicates(&list);
+
+    if (list.num_files == 0) {
+        fprintf(stderr,
+                "Directory contains no files. There is nothing to do\n");
+        exit(0);
+    }
+
+    printf("Directory contains %lu files:\n", list.num_files);
+    for (size_t i = 0; i < list.num_files; ++i)
+        printf("%lu. %s\n", i, list.names[i]);
+
+    // File can be selected either by its number or by its name.
     int32 number, addr_from, addr_to;
-    printf("Select a file: ");
-    scanf("%d", &number);
+    char selection[PATH_MAX];
+    printf("Select a file (number or name): ");
+    if (!fgets(selection, sizeof(selection), stdin)) {
+        fprintf(stderr, "ERROR: No file selected\n");
+        exit(1);
+    }
+
+    // Name is tried first, so that files named like numbers can be selected.
+    selection[strcspn(selection, "\r\n")] = '\0';
+    ssize_t found = filelist_find(&list, selection);
+    char *selection_end;
+    long selected_number = strtol(selection, &selection_end, 10);
+    if (found != -1) {
+        number = (int32)found;
+    }
+    else if (selection[0] != '\0' && *selection_end == '\0') {
+        number = (selected_number < 0 || selected_number > INT32_MAX
+                      ? -1
+                      : (int32)selected_number);
+    }
+    else {
+        fprintf(stderr, "ERROR: There is no file named %s\n", selection);
+        exit(1);
+    }
+
     printf("Address from: ");
     scanf("%d", &addr_from);
     printf("Address to (exclusive): ");
     scanf("%d", &addr_to);
 
     // If this won't exit program, inserted values are valid.
-    sanitize_selected_file_input(number, addr_from, addr_to,
-                                 filelist.num_files);
+    sanitize_selected_file_input(number, addr_from, addr_to, list.num_files);
 
-    char const *nameptr = filelist.filenames;
-    for (int32 i = 0; i != number; ++i) {
-        nameptr = strchr(nameptr, '\0');
-        assert(nameptr);
-        ++nameptr;
+    char const *nameptr = list.names[number];
+    size_t nameptr_len = strlen(nameptr);
+    if (nameptr_len > 0 && nameptr[nameptr_len - 1] == '/') {
+        fprintf(stderr, "ERROR: %s is a directory\n", nameptr);
+        exit(1);
     }
 
-    char *selected_name = strdup(nameptr);
-    filelist_response_free(
-        &filelist); // We dont need filelist response any more.
-    snd_file_request(msg_sock, addr_from, addr_to, selected_name);
-
-    filechunk_response filechunk;
-    rvc_filechunk(msg_sock, &filechunk);
+    // Files from the listed directory are requested with the path relative to
+    // the served directory.
+    size_t dir_len = (idata.dir ? strlen(idata.dir) : 0);
+    char *selected_name = malloc(dir_len + 1 + nameptr_len + 1);
+    if (!selected_name) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
 
-    // If error code was set, server has refused.
-    if (filechunk.error_code) {
-        printf("Server refused, reason: %s\n",
-               file_refuse_tostr(filechunk.error_code));
+    if (dir_len > 0)
+        sprintf(selected_name, "%s/%s", idata.dir, nameptr);
+    else
+        strcpy(selected_name, nameptr);
+    filelist_free(&list); // We dont need filelist response any more.
+    int msg_sock = owner_sock(&conns, selected_name);
+    if (idata.local_path) {
+        fetch_local_chunk(msg_sock, selected_name, addr_from, addr_to);
     }
     else {
-        write_to_tmp_file_at_offset(selected_name, addr_from, filechunk.data,
-                                    filechunk.data_len);
+        snd_file_request(msg_sock, request_code, addr_from, addr_to,
+                         selected_name);
+        rcv_filechunk_to_tmp_file(msg_sock, selected_name, addr_from);
     }
 
     free(selected_name);
-    filechunk_response_free(&filechunk);
-    CHECK(close(msg_sock));
+    close_all(&conns);
     return 0;
 }
@@ -0,0 +1,198 @@
+#include <assert.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "lz.h"
+
+#define LZ_MIN_MATCH (4)
+#define LZ_HASH_LOG (12)
+#define LZ_MAX_OFFSET (65535)
+
+// Required by the LZ4 block format: last 5 bytes are always literals, and the
+// last match has to start at least 12 bytes before the end of the block.
+#define LZ_LAST_LITERALS (5)
+#define LZ_MFLIMIT (12)
+
+// After that many misses in a row, we start skipping bytes. This makes
+// incompressible data go through the compressor much faster.
+#define LZ_SKIP_TRIGGER (6)
+
+static inline uint32 lz_read32(uint8 const *data) {
+    uint32 retval;
+    memcpy(&retval, data, 4);
+    return retval;
+}
+
+static inline uint32 lz_hash(uint32 sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+// Number of bytes taken by the sequence with given lengths in the worst case.
+static inline size_t lz_sequence_size(size_t lit_len, size_t match_len) {
+    return 1 + (lit_len / 255 + 1) + lit_len + 2 + (match_len / 255 + 1);
+}
+
+static uint8 *lz_put_length(uint8 *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+
+    *op++ = (uint8)len;
+    return op;
+}
+
+static uint8 *lz_put_literals(uint8 *op, uint8 const *literals, size_t lit_len,
+                              size_t match_len) {
+    uint8 *token = op++;
+    *token = (uint8)(((lit_len >= 15 ? 15 : lit_len) << 4) |
+                     (match_len >= 15 ? 15 : match_len));
+    if (lit_len >= 15)
+        op = lz_put_length(op, lit_len - 15);
+
+    memcpy(op, literals, lit_len);
+    return op + lit_len;
+}
+
+size_t lz_compress(uint8 const *src, size_t src_len, uint8 *dst,
+                   size_t dst_cap) {
+    uint32 table[1 << LZ_HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    uint8 const *ip = src;
+    uint8 const *anchor = src;
+    uint8 const *iend = src + src_len;
+    uint8 *op = dst;
+    uint8 *oend = dst + dst_cap;
+
+    if (src_len > LZ_MFLIMIT) {
+        uint8 const *mflimit = iend - LZ_MFLIMIT;
+        uint8 const *matchlimit = iend - LZ_LAST_LITERALS;
+        size_t misses = 0;
+
+        while (ip < mflimit) {
+            uint32 sequence = lz_read32(ip);
+            uint32 hash = lz_hash(sequence);
+            uint8 const *ref = src + table[hash];
+            table[hash] = (uint32)(ip - src);
+
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+                lz_read32(ref) != sequence) {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+
+            misses = 0;
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                --ip;
+                --ref;
+            }
+
+            uint8 const *match_end = ip + LZ_MIN_MATCH;
+            uint8 const *ref_end = ref + LZ_MIN_MATCH;
+            while (match_end < matchlimit && *match_end == *ref_end) {
+                ++match_end;
+                ++ref_end;
+            }
+
+            size_t lit_len = ip - anchor;
+            size_t match_len = match_end - ip - LZ_MIN_MATCH;
+            if (lz_sequence_size(lit_len, match_len) > (size_t)(oend - op))
+                return 0;
+
+            op = lz_put_literals(op, anchor, lit_len, match_len);
+            uint16 offset = (uint16)(ip - ref);
+            *op++ = (uint8)(offset & 0xFF);
+            *op++ = (uint8)(offset >> 8);
+            if (match_len >= 15)
+                op = lz_put_length(op, match_len - 15);
+
+            ip = match_end;
+            anchor = ip;
+        }
+    }
+
+    // The rest is sent as a last, literal-only sequence.
+    size_t lit_len = iend - anchor;
+    if (1 + (lit_len / 255 + 1) + lit_len > (size_t)(oend - op))
+        return 0;
+
+    op = lz_put_literals(op, anchor, lit_len, 0);
+    assert(op <= oend);
+
+    return op - dst;
+}
+
+// Reads the length continuation bytes. Returns -1 if input ends too early.
+static int lz_get_length(uint8 const **ipptr, uint8 const *iend, size_t *len) {
+    uint8 byte;
+    do {
+        if (*ipptr >= iend)
+            return -1;
+
+        byte = *(*ipptr)++;
+        *len += byte;
+    } while (byte == 255);
+
+    return 0;
+}
+
+int lz_decompress(uint8 const *src, size_t src_len, uint8 *dst,
+                  size_t dst_len) {
+    uint8 const *ip = src;
+    uint8 const *iend = src + src_len;
+    uint8 *op = dst;
+    uint8 *oend = dst + dst_len;
+
+    while (ip < iend) {
+        uint8 token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && lz_get_length(&ip, iend, &lit_len) == -1)
+            goto malformed;
+
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+            goto malformed;
+
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Last sequence has no match part.
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            goto malformed;
+
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst))
+            goto malformed;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && lz_get_length(&ip, iend, &match_len) == -1)
+            goto malformed;
+
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(oend - op))
+            goto malformed;
+
+        // Regions can overlap, so the copy is done byte by byte.
+        uint8 const *ref = op - offset;
+        for (size_t i = 0; i != match_len; ++i)
+            *op++ = *ref++;
+    }
+
+    if (op != oend)
+        goto malformed;
+
+    return 0;
+
+malformed:
+    errno = EBADMSG;
+    return -1;
+}
@@ -0,0 +1,25 @@
+#ifndef LZ_H
+#define LZ_H
+
+// A small, fast LZ77 compressor that uses the LZ4 block format. It is meant to
+// trade the compression ratio for speed, so that compressing a chunk is cheaper
+// than sending the bytes saved by it.
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Compress [src_len] bytes from [src] into [dst], which is [dst_cap] bytes
+// long. Returns the size of the compressed data or 0 if it does not fit in
+// [dst_cap] bytes. Passing [dst_cap] smaller than [src_len] makes the function
+// give up early on data that does not compress.
+size_t lz_compress(uint8 const *src, size_t src_len, uint8 *dst,
+                   size_t dst_cap);
+
+// Decompress [src_len] bytes from [src] into [dst]. Exacly [dst_len] bytes are
+// expected to be produced. Returns 0 on success, or -1 if the data is malformed
+// (in that case errno is set to EBADMSG).
+int lz_decompress(uint8 const *src, size_t src_len, uint8 *dst,
+                  size_t dst_len);
+
+#endif // LZ_H
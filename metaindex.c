@@ -0,0 +1,830 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "exbuffer.h"
+#include "metaindex.h"
+
+#define METAINDEX_MAGIC "NSMI"
+#define METAINDEX_VERSION (4)
+#define METAINDEX_MIN_INITAIL_CAPACITY (64)
+
+// Timestamps are updated with a coarse clock, so a directory modified right
+// after we've scanned it may keep the same mtime. Directories modified less
+// than that many seconds before the scan are therefore never trusted to be
+// unchanged, and are scanned again on the next refresh.
+#define METAINDEX_RACY_SECONDS (2)
+
+typedef struct {
+    char magic[4];
+    uint32 version;
+    uint64 num_entries;
+    uint64 names_size;
+    uint64 root_dev;
+    uint64 root_ino;
+} metaindex_file_header;
+
+// Directory entry read by readdir, before it is put into the index.
+typedef struct {
+    char *name;
+    struct stat filestat;
+} scanned_entry;
+
+// Directory that is waiting to have its children put into the new index.
+typedef struct {
+    uint32 fresh_idx;
+    int64 old_idx; // -1 if directory is not in the old index.
+    char *path;
+} pending_dir;
+
+typedef struct {
+    pending_dir *dirs;
+    size_t size;
+    size_t capacity;
+} pending_queue;
+
+int metaindex_init(metaindex *self) {
+    self->entries =
+        malloc(METAINDEX_MIN_INITAIL_CAPACITY * sizeof(metaindex_entry));
+    if (!self->entries) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    self->num_entries = 0;
+    self->entries_capacity = METAINDEX_MIN_INITAIL_CAPACITY;
+    self->num_dead = 0;
+    self->root_dev = 0;
+    self->root_ino = 0;
+
+    if (exbuffer_init(&self->names) == -1) {
+        free(self->entries);
+        return -1;
+    }
+
+    return 0;
+}
+
+void metaindex_free(metaindex *self) {
+    free(self->entries);
+    exbuffer_free(&self->names);
+}
+
+// Makes an entry with everything but the name filled from the stat result.
+// Only directories have the mtime, as nothing is kept about the contents of
+// files, which would go stale without their parent changing.
+static metaindex_entry entry_from_stat(uint32 type,
+                                       struct stat const *filestat) {
+    metaindex_entry retval;
+    retval.name_offset = 0;
+    retval.name_len = 0;
+    retval.first_child = 0;
+    retval.num_children = 0;
+    retval.mtime_sec = 0;
+    retval.mtime_nsec = 0;
+    retval.type = type;
+
+    if (type == METAINDEX_TYPE_DIR) {
+        retval.mtime_sec = filestat->st_mtim.tv_sec;
+        retval.mtime_nsec = filestat->st_mtim.tv_nsec;
+        if (time(0) - filestat->st_mtim.tv_sec < METAINDEX_RACY_SECONDS)
+            retval.mtime_sec = -1;
+    }
+
+    return retval;
+}
+
+// Tells whether two entries of the same directory have the same mtime. Racy
+// mtime on either side is never the same, as the directory could have changed
+// without changing it.
+static int same_mtime(metaindex_entry const *lhs, metaindex_entry const *rhs) {
+    return (lhs->mtime_sec != -1 && rhs->mtime_sec != -1 &&
+            lhs->mtime_sec == rhs->mtime_sec &&
+            lhs->mtime_nsec == rhs->mtime_nsec);
+}
+
+// Makes room for one more entry. Returns 0 on success or -1 if malloc failed.
+static int reserve_entry(metaindex *self) {
+    if (self->num_entries == self->entries_capacity) {
+        size_t new_capacity = self->entries_capacity * 2;
+        metaindex_entry *new_entries =
+            realloc(self->entries, new_capacity * sizeof(metaindex_entry));
+        if (!new_entries) {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        self->entries = new_entries;
+        self->entries_capacity = new_capacity;
+    }
+
+    return 0;
+}
+
+// Appends the copy of [entry] with the given name and returns its index, or -1
+// if malloc failed.
+static ssize_t metaindex_push(metaindex *self, char const *name,
+                              size_t name_len, metaindex_entry entry) {
+    if (reserve_entry(self) == -1)
+        return -1;
+
+    entry.name_offset = (uint32)self->names.size;
+    entry.name_len = (uint32)name_len;
+    entry.first_child = 0;
+    entry.num_children = 0;
+    if (exbuffer_append(&self->names, (uint8 *)name, name_len) == -1)
+        return -1;
+
+    self->entries[self->num_entries] = entry;
+    return self->num_entries++;
+}
+
+// Appends the copy of the entry [idx], which shares the name and the children
+// with it. Returns the index of the copy, or -1 if malloc failed.
+static ssize_t metaindex_push_copy(metaindex *self, size_t idx) {
+    if (reserve_entry(self) == -1)
+        return -1;
+
+    self->entries[self->num_entries] = self->entries[idx];
+    return self->num_entries++;
+}
+
+// Compares names the same way strcmp does, as names in the index are not null
+// terminated.
+static int name_cmp(char const *lhs, size_t lhs_len, char const *rhs,
+                    size_t rhs_len) {
+    int retval = memcmp(lhs, rhs, lhs_len < rhs_len ? lhs_len : rhs_len);
+    if (retval == 0)
+        retval = (lhs_len > rhs_len) - (lhs_len < rhs_len);
+
+    return retval;
+}
+
+// Binary search over the children of the directory. Returns the index of the
+// child with the given name or -1 if there is none.
+static ssize_t find_child(metaindex const *self, size_t dir_idx,
+                          char const *name, size_t name_len) {
+    metaindex_entry const *dir = &self->entries[dir_idx];
+    if (dir->type != METAINDEX_TYPE_DIR)
+        return -1;
+
+    size_t lo = dir->first_child;
+    size_t hi = (size_t)dir->first_child + dir->num_children;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        metaindex_entry const *entry = &self->entries[mid];
+        int cmp = name_cmp((char const *)self->names.data + entry->name_offset,
+                           entry->name_len, name, name_len);
+        if (cmp == 0)
+            return mid;
+        else if (cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return -1;
+}
+
+ssize_t metaindex_find(metaindex const *self, char const *path) {
+    if (self->num_entries == 0)
+        return -1;
+
+    size_t idx = 0;
+    while (*path) {
+        size_t component_len = strcspn(path, "/");
+        ssize_t child = find_child(self, idx, path, component_len);
+        if (child == -1)
+            return -1;
+
+        idx = child;
+        path += component_len;
+        if (*path == '/')
+            ++path;
+    }
+
+    return idx;
+}
+
+static int scanned_entry_cmp(void const *lhs, void const *rhs) {
+    return strcmp(((scanned_entry const *)lhs)->name,
+                  ((scanned_entry const *)rhs)->name);
+}
+
+// Reads all regular files and directories from the directory under [path].
+// The result is sorted by name and has to be freed with scanned_entries_free.
+// Returns 0 on success or -1 on failure with errno set.
+static int scan_directory(char const *path, scanned_entry **result,
+                          size_t *result_len) {
+    size_t path_len = strlen(path);
+    char path_combined[path_len + 1 + NAME_MAX + 1];
+    strcpy(path_combined, path);
+    strcpy(&path_combined[path_len], "/");
+
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+
+    size_t capacity = METAINDEX_MIN_INITAIL_CAPACITY;
+    size_t len = 0;
+    scanned_entry *entries = malloc(capacity * sizeof(scanned_entry));
+    if (!entries) {
+        closedir(d);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Dirent does not guarantee d_type so we use lstat to select files and
+    // directories only. Symlinks are skipped, as the server refuses to follow
+    // them (they could lead outside of the served directory or make a cycle).
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+        if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+            continue;
+
+        struct stat filestat;
+        strcpy(&path_combined[path_len] + 1, dir->d_name);
+        if (lstat(path_combined, &filestat) == -1)
+            continue; // File was removed in the meantime.
+
+        if (!S_ISREG(filestat.st_mode) && !S_ISDIR(filestat.st_mode))
+            continue;
+
+        if (len == capacity) {
+            capacity *= 2;
+            scanned_entry *new_entries =
+                realloc(entries, capacity * sizeof(scanned_entry));
+            if (!new_entries) {
+                errno = ENOMEM;
+                FAILWITH_ERRNO();
+            }
+
+            entries = new_entries;
+        }
+
+        entries[len].name = strdup(dir->d_name);
+        if (!entries[len].name) {
+            errno = ENOMEM;
+            FAILWITH_ERRNO();
+        }
+
+        entries[len].filestat = filestat;
+        ++len;
+    }
+
+    closedir(d);
+    qsort(entries, len, sizeof(scanned_entry), scanned_entry_cmp);
+
+    *result = entries;
+    *result_len = len;
+    return 0;
+}
+
+static void scanned_entries_free(scanned_entry *entries, size_t len) {
+    for (size_t i = 0; i != len; ++i)
+        free(entries[i].name);
+
+    free(entries);
+}
+
+static char *path_join(char const *dirpath, char const *name,
+                       size_t name_len) {
+    size_t dirpath_len = strlen(dirpath);
+    char *retval = malloc(dirpath_len + 1 + name_len + 1);
+    if (!retval) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    memcpy(retval, dirpath, dirpath_len);
+    retval[dirpath_len] = '/';
+    memcpy(retval + dirpath_len + 1, name, name_len);
+    retval[dirpath_len + 1 + name_len] = '\0';
+    return retval;
+}
+
+static void pending_queue_push(pending_queue *self, uint32 fresh_idx,
+                               int64 old_idx, char *path) {
+    if (self->size == self->capacity) {
+        self->capacity = (self->capacity ? self->capacity * 2
+                                         : METAINDEX_MIN_INITAIL_CAPACITY);
+        pending_dir *new_dirs =
+            realloc(self->dirs, self->capacity * sizeof(pending_dir));
+        if (!new_dirs) {
+            errno = ENOMEM;
+            FAILWITH_ERRNO();
+        }
+
+        self->dirs = new_dirs;
+    }
+
+    self->dirs[self->size].fresh_idx = fresh_idx;
+    self->dirs[self->size].old_idx = old_idx;
+    self->dirs[self->size].path = path;
+    self->size++;
+}
+
+// Puts children of the directory into the new index. If the directory has not
+// been modified since the old index was made, its children are copied from the
+// old index and only subdirectories are stat'ed, otherwise the directory is
+// scanned. Subdirectories are queued to be processed later, so that children
+// of every directory are next to each other. Returns 1 if the directory has
+// changed, 0 if it has not and -1 if it could not be scanned.
+static int refresh_directory(metaindex const *old, metaindex *fresh,
+                             pending_dir *dir, pending_queue *queue) {
+    metaindex_entry const *old_dir =
+        (dir->old_idx >= 0 ? &old->entries[dir->old_idx] : 0);
+    uint32 first_child = (uint32)fresh->num_entries;
+    int retval = 0;
+
+    if (old_dir && old_dir->type == METAINDEX_TYPE_DIR &&
+        same_mtime(old_dir, &fresh->entries[dir->fresh_idx])) {
+        for (uint32 i = 0; i != old_dir->num_children; ++i) {
+            size_t old_idx = (size_t)old_dir->first_child + i;
+            metaindex_entry const *child = &old->entries[old_idx];
+            char const *name =
+                (char const *)old->names.data + child->name_offset;
+
+            if (child->type == METAINDEX_TYPE_FILE) {
+                CHECK(metaindex_push(fresh, name, child->name_len, *child));
+                continue;
+            }
+
+            char *path = path_join(dir->path, name, child->name_len);
+            struct stat filestat;
+            if (lstat(path, &filestat) == -1 || !S_ISDIR(filestat.st_mode)) {
+                free(path);
+                retval = 1;
+                continue;
+            }
+
+            ssize_t fresh_idx;
+            CHECK(fresh_idx = metaindex_push(
+                      fresh, name, child->name_len,
+                      entry_from_stat(METAINDEX_TYPE_DIR, &filestat)));
+            pending_queue_push(queue, fresh_idx, old_idx, path);
+        }
+    }
+    else {
+        scanned_entry *scanned;
+        size_t num_scanned;
+        if (scan_directory(dir->path, &scanned, &num_scanned) == -1)
+            return -1;
+
+        retval = 1;
+        for (size_t i = 0; i != num_scanned; ++i) {
+            char const *name = scanned[i].name;
+            size_t name_len = strlen(name);
+            if (S_ISREG(scanned[i].filestat.st_mode)) {
+                CHECK(metaindex_push(fresh, name, name_len,
+                                     entry_from_stat(METAINDEX_TYPE_FILE,
+                                                     &scanned[i].filestat)));
+                continue;
+            }
+
+            ssize_t old_idx =
+                (old_dir ? find_child(old, dir->old_idx, name, name_len) : -1);
+            ssize_t fresh_idx;
+            CHECK(fresh_idx = metaindex_push(
+                      fresh, name, name_len,
+                      entry_from_stat(METAINDEX_TYPE_DIR,
+                                      &scanned[i].filestat)));
+            pending_queue_push(queue, fresh_idx, old_idx,
+                               path_join(dir->path, name, name_len));
+        }
+
+        scanned_entries_free(scanned, num_scanned);
+    }
+
+    fresh->entries[dir->fresh_idx].first_child = first_child;
+    fresh->entries[dir->fresh_idx].num_children =
+        (uint32)(fresh->num_entries - first_child);
+    return retval;
+}
+
+int metaindex_refresh(metaindex *self, char const *dirname) {
+    struct stat root_stat;
+    if (stat(dirname, &root_stat) == -1)
+        return -1;
+
+    if (!S_ISDIR(root_stat.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    metaindex fresh;
+    if (metaindex_init(&fresh) == -1)
+        return -1;
+
+    fresh.root_dev = root_stat.st_dev;
+    fresh.root_ino = root_stat.st_ino;
+    CHECK(metaindex_push(&fresh, "", 0,
+                         entry_from_stat(METAINDEX_TYPE_DIR, &root_stat)));
+
+    // Index made for a different directory can't be reused.
+    int changed = (self->num_entries == 0 ||
+                   self->root_dev != (uint64)root_stat.st_dev ||
+                   self->root_ino != (uint64)root_stat.st_ino);
+
+    pending_queue queue;
+    queue.dirs = 0;
+    queue.size = 0;
+    queue.capacity = 0;
+    pending_queue_push(&queue, 0, (changed ? -1 : 0), strdup(dirname));
+
+    int retval = 0;
+    for (size_t i = 0; i != queue.size; ++i) {
+        // Queue can be reallocated while the directory is processed.
+        pending_dir dir = queue.dirs[i];
+        int dir_result = refresh_directory(self, &fresh, &dir, &queue);
+        if (dir_result == -1 && i == 0) {
+            retval = -1;
+        }
+        else if (dir_result == -1) {
+            // Subdirectory we can't read is served as empty. It will be
+            // scanned again on the next refresh.
+            fprintf(stderr, "WARNING: Could not scan %s: %s\n", dir.path,
+                    strerror(errno));
+            fresh.entries[dir.fresh_idx].mtime_sec = -1;
+            changed = 1;
+        }
+        else if (dir_result == 1) {
+            changed = 1;
+        }
+
+        free(dir.path);
+        if (retval == -1) {
+            for (size_t j = i + 1; j < queue.size; ++j)
+                free(queue.dirs[j].path);
+            break;
+        }
+    }
+
+    free(queue.dirs);
+    if (retval == -1 || (!changed && self->num_dead == 0)) {
+        metaindex_free(&fresh);
+        return retval;
+    }
+
+    metaindex_free(self);
+    *self = fresh;
+    return changed;
+}
+
+// Copies the entries reachable from the root to [fresh], dropping the dead
+// ones, so that children follow their parent again. Until a copied directory
+// is reached, its first_child still points to its children in [self]. They
+// are then copied behind everything copied so far.
+static void compact_into(metaindex const *self, metaindex *fresh) {
+    CHECK(metaindex_init(fresh));
+    fresh->root_dev = self->root_dev;
+    fresh->root_ino = self->root_ino;
+    if (self->num_entries == 0)
+        return;
+
+    CHECK(metaindex_push(fresh, "", 0, self->entries[0]));
+    fresh->entries[0].first_child = self->entries[0].first_child;
+    fresh->entries[0].num_children = self->entries[0].num_children;
+
+    for (size_t i = 0; i != fresh->num_entries; ++i) {
+        if (fresh->entries[i].type != METAINDEX_TYPE_DIR)
+            continue;
+
+        uint32 old_first_child = fresh->entries[i].first_child;
+        uint32 num_children = fresh->entries[i].num_children;
+        fresh->entries[i].first_child = (uint32)fresh->num_entries;
+        for (uint32 j = 0; j != num_children; ++j) {
+            metaindex_entry const *child =
+                &self->entries[(size_t)old_first_child + j];
+            char const *name =
+                (char const *)self->names.data + child->name_offset;
+            ssize_t idx;
+            CHECK(idx = metaindex_push(fresh, name, child->name_len, *child));
+            fresh->entries[idx].first_child = child->first_child;
+            fresh->entries[idx].num_children = child->num_children;
+        }
+    }
+}
+
+// Scans the directory [dir_idx] under [path] again and appends its children
+// at the end of the index, leaving the old ones dead. Subdirectories that were
+// there before are copied together with their subtrees and old mtimes, new
+// ones are added as not scanned yet. Either way they are scanned when a
+// refreshed path leads through them. [dirstat] has to be taken before the
+// scan. Returns 0 on success or -1 if the directory could not be scanned.
+static int rescan_directory(metaindex *self, size_t dir_idx, char const *path,
+                            struct stat const *dirstat) {
+    scanned_entry *scanned;
+    size_t num_scanned;
+    if (scan_directory(path, &scanned, &num_scanned) == -1)
+        return -1;
+
+    uint32 first_child = (uint32)self->num_entries;
+    for (size_t i = 0; i != num_scanned; ++i) {
+        char const *name = scanned[i].name;
+        size_t name_len = strlen(name);
+        if (S_ISREG(scanned[i].filestat.st_mode)) {
+            CHECK(metaindex_push(self, name, name_len,
+                                 entry_from_stat(METAINDEX_TYPE_FILE,
+                                                 &scanned[i].filestat)));
+            continue;
+        }
+
+        ssize_t old_idx = find_child(self, dir_idx, name, name_len);
+        if (old_idx != -1 &&
+            self->entries[old_idx].type == METAINDEX_TYPE_DIR) {
+            CHECK(metaindex_push_copy(self, old_idx));
+            continue;
+        }
+
+        metaindex_entry entry =
+            entry_from_stat(METAINDEX_TYPE_DIR, &scanned[i].filestat);
+        entry.mtime_sec = -1;
+        CHECK(metaindex_push(self, name, name_len, entry));
+    }
+
+    scanned_entries_free(scanned, num_scanned);
+
+    metaindex_entry current = entry_from_stat(METAINDEX_TYPE_DIR, dirstat);
+    metaindex_entry *dir = &self->entries[dir_idx];
+    self->num_dead += dir->num_children;
+    dir->mtime_sec = current.mtime_sec;
+    dir->mtime_nsec = current.mtime_nsec;
+    dir->first_child = first_child;
+    dir->num_children = (uint32)(self->num_entries - first_child);
+    return 0;
+}
+
+int metaindex_refresh_path(metaindex *self, char const *dirname,
+                           char const *path) {
+    struct stat filestat;
+    if (stat(dirname, &filestat) == -1)
+        return -1;
+
+    if (self->num_entries == 0 ||
+        self->root_dev != (uint64)filestat.st_dev ||
+        self->root_ino != (uint64)filestat.st_ino) {
+        return metaindex_refresh(self, dirname);
+    }
+
+    if (!S_ISDIR(filestat.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+    }
+
+    size_t dirname_len = strlen(dirname);
+    char dir_path[dirname_len + 1 + strlen(path) + 1];
+    strcpy(dir_path, dirname);
+
+    int retval = 0;
+    size_t idx = 0;
+    for (;;) {
+        metaindex_entry current =
+            entry_from_stat(METAINDEX_TYPE_DIR, &filestat);
+        if (!same_mtime(&self->entries[idx], &current)) {
+            retval = 1;
+            if (rescan_directory(self, idx, dir_path, &filestat) == -1) {
+                if (idx == 0)
+                    return -1;
+
+                // Subdirectory we can't read is served as empty. It will be
+                // scanned again on the next refresh.
+                fprintf(stderr, "WARNING: Could not scan %s: %s\n", dir_path,
+                        strerror(errno));
+                self->num_dead += self->entries[idx].num_children;
+                self->entries[idx].num_children = 0;
+                self->entries[idx].mtime_sec = -1;
+            }
+        }
+
+        if (*path == '\0')
+            break;
+
+        // Directory is up to date now, so a name missing from it is missing
+        // on the disk as well.
+        size_t component_len = strcspn(path, "/");
+        ssize_t child = find_child(self, idx, path, component_len);
+        if (child == -1 || self->entries[child].type != METAINDEX_TYPE_DIR)
+            break;
+
+        strcat(dir_path, "/");
+        strncat(dir_path, path, component_len);
+        if (lstat(dir_path, &filestat) == -1 || !S_ISDIR(filestat.st_mode))
+            break;
+
+        idx = child;
+        path += component_len;
+        if (*path == '/')
+            ++path;
+    }
+
+    // Compacting costs as much as the entries dropped since the last time.
+    if (self->num_dead > self->num_entries / 2) {
+        metaindex compacted;
+        compact_into(self, &compacted);
+        metaindex_free(self);
+        *self = compacted;
+    }
+
+    return retval;
+}
+
+int metaindex_append_listing(metaindex const *self, size_t dir_idx,
+                             int with_dirs, exbuffer *ebufptr) {
+    if (self->num_entries == 0)
+        return 0;
+
+    metaindex_entry const *dir = &self->entries[dir_idx];
+    assert(dir->type == METAINDEX_TYPE_DIR);
+
+    int first_appended = 0;
+    for (uint32 i = 0; i != dir->num_children; ++i) {
+        metaindex_entry const *entry = &self->entries[dir->first_child + i];
+        if (entry->type != METAINDEX_TYPE_FILE && !with_dirs)
+            continue;
+
+        char separator[] = "|";
+        char dir_suffix[] = "/";
+        if ((first_appended && exbuffer_append(ebufptr, (uint8 *)separator,
+                                               sizeof(separator) - 1) == -1) ||
+            exbuffer_append(ebufptr, self->names.data + entry->name_offset,
+                            entry->name_len) == -1 ||
+            (entry->type == METAINDEX_TYPE_DIR &&
+             exbuffer_append(ebufptr, (uint8 *)dir_suffix,
+                             sizeof(dir_suffix) - 1) == -1)) {
+            return -1;
+        }
+
+        first_appended = 1;
+    }
+
+    return 0;
+}
+
+// Checks that all offsets and indexes in the mapped index are in bounds, so
+// that a corrupted file can't make us read outside of the mapping.
+static int validate_entries(metaindex_entry const *entries, uint64 num_entries,
+                            uint64 names_size) {
+    if (num_entries == 0 || entries[0].type != METAINDEX_TYPE_DIR)
+        return -1;
+
+    for (uint64 i = 0; i != num_entries; ++i) {
+        metaindex_entry const *entry = &entries[i];
+        if ((uint64)entry->name_offset + entry->name_len > names_size)
+            return -1;
+
+        if (entry->type == METAINDEX_TYPE_DIR) {
+            // Children always follow their parent, so there can be no cycles.
+            if (entry->num_children > 0 &&
+                (entry->first_child <= i ||
+                 (uint64)entry->first_child + entry->num_children >
+                     num_entries)) {
+                return -1;
+            }
+        }
+        else if (entry->type != METAINDEX_TYPE_FILE ||
+                 entry->num_children != 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int metaindex_load(metaindex *self, char const *path) {
+    self->num_entries = 0;
+    self->num_dead = 0;
+    self->names.size = 0;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    struct stat filestat;
+    if (fstat(fd, &filestat) == -1 ||
+        (size_t)filestat.st_size < sizeof(metaindex_file_header)) {
+        close(fd);
+        return -1;
+    }
+
+    size_t file_size = filestat.st_size;
+    uint8 *data = mmap(0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return -1;
+
+    int retval = -1;
+    metaindex_file_header header;
+    memcpy(&header, data, sizeof(header));
+
+    size_t body_size = file_size - sizeof(header);
+    if (memcmp(header.magic, METAINDEX_MAGIC, 4) == 0 &&
+        header.version == METAINDEX_VERSION &&
+        header.num_entries <= body_size / sizeof(metaindex_entry) &&
+        header.names_size ==
+            body_size - header.num_entries * sizeof(metaindex_entry) &&
+        header.names_size <= UINT32_MAX) {
+        metaindex_entry const *entries =
+            (metaindex_entry const *)(data + sizeof(header));
+        uint8 *names = data + sizeof(header) +
+                       header.num_entries * sizeof(metaindex_entry);
+
+        if (validate_entries(entries, header.num_entries, header.names_size) ==
+                0 &&
+            exbuffer_reserve(&self->names, header.names_size) == 0) {
+            metaindex_entry *new_entries =
+                realloc(self->entries,
+                        header.num_entries * sizeof(metaindex_entry));
+            if (new_entries) {
+                self->entries = new_entries;
+                self->entries_capacity = header.num_entries;
+                self->num_entries = header.num_entries;
+                self->num_dead = 0;
+                memcpy(self->entries, entries,
+                       header.num_entries * sizeof(metaindex_entry));
+                memcpy(self->names.data, names, header.names_size);
+                self->names.size = header.names_size;
+                self->root_dev = header.root_dev;
+                self->root_ino = header.root_ino;
+                retval = 0;
+            }
+        }
+    }
+
+    munmap(data, file_size);
+    return retval;
+}
+
+static int write_all(int fd, void const *data, size_t len) {
+    uint8 const *curr = data;
+    while (len > 0) {
+        ssize_t written = write(fd, curr, len);
+        if (written == -1)
+            return -1;
+
+        curr += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+int metaindex_save(metaindex const *self, char const *path) {
+    // File has children after their parent, which dead entries could break.
+    if (self->num_dead > 0) {
+        metaindex compacted;
+        compact_into(self, &compacted);
+        int retval = metaindex_save(&compacted, path);
+        int saved_errno = errno;
+        metaindex_free(&compacted);
+        errno = saved_errno;
+        return retval;
+    }
+
+    size_t path_len = strlen(path);
+    char tmp_suffix[] = ".tmp";
+    char tmp_path[path_len + sizeof(tmp_suffix)];
+    strcpy(tmp_path, path);
+    strcpy(&tmp_path[path_len], tmp_suffix);
+
+    metaindex_file_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, METAINDEX_MAGIC, 4);
+    header.version = METAINDEX_VERSION;
+    header.num_entries = self->num_entries;
+    header.names_size = self->names.size;
+    header.root_dev = self->root_dev;
+    header.root_ino = self->root_ino;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return -1;
+
+    if (write_all(fd, &header, sizeof(header)) == -1 ||
+        write_all(fd, self->entries,
+                  self->num_entries * sizeof(metaindex_entry)) == -1 ||
+        write_all(fd, self->names.data, self->names.size) == -1 ||
+        fsync(fd) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        unlink(tmp_path);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (close(fd) == -1 || rename(tmp_path, path) == -1)
+        return -1;
+
+    return 0;
+}
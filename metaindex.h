@@ -0,0 +1,91 @@
+#ifndef METAINDEX_H
+#define METAINDEX_H
+
+// Names of the files and directories in the served directory tree, with the
+// mtimes of directories used to tell which ones have to be scanned again.
+// Sizes of files are not kept, as they change without the directory changing;
+// the file is stat'ed when its chunk is requested.
+// The index can be saved to a file and loaded back when the server starts, so
+// that the tree does not have to be scanned again if it has not changed since.
+//
+// Entries are stored in a flat array. Entry 0 is the served directory itself
+// and the children of every directory are kept next to each other, sorted by
+// name. The index file is just a header followed by the entries array and the
+// names, so it can be mmaped and validated without parsing anything. It is
+// written in the native byte order, as it is never sent over the network.
+
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "exbuffer.h"
+
+#define METAINDEX_TYPE_FILE (1)
+#define METAINDEX_TYPE_DIR (2)
+
+typedef struct {
+    uint32 name_offset; // Offset of the name in the names buffer.
+    uint32 name_len;
+    uint32 first_child; // Only for directories.
+    uint32 num_children;
+    int64 mtime_sec; // Only for directories.
+    uint32 mtime_nsec;
+    uint32 type;
+} metaindex_entry;
+
+typedef struct {
+    metaindex_entry *entries;
+    size_t num_entries;
+    size_t entries_capacity;
+    exbuffer names; // Names are NOT null-terminated.
+    size_t num_dead; // Entries left behind by rescans, not reachable anymore.
+    uint64 root_dev;
+    uint64 root_ino;
+} metaindex;
+
+// -1 is returned when malloc failes, otherwise 0.
+int metaindex_init(metaindex *self);
+
+void metaindex_free(metaindex *self);
+
+// Replaces the contents of the index with the one saved in the file under
+// [path]. Returns 0 on success, or -1 if the file does not exist, has
+// different version or is malformed. In that case the index is left empty.
+int metaindex_load(metaindex *self, char const *path);
+
+// Writes the index to a temporary file and renames it to [path], so that the
+// file under [path] is always complete. Returns 0 on success or -1 on failure
+// with errno set.
+int metaindex_save(metaindex const *self, char const *path);
+
+// Brings the index up to date with the directory tree under [dirname]. Only
+// directories are stat'ed, and only the ones modified since the last refresh
+// are scanned again. Returns 1 if the index has changed, 0 if it has not and -1
+// on failure with errno set.
+int metaindex_refresh(metaindex *self, char const *dirname);
+
+// Same as metaindex_refresh, but brings up to date only the directories on
+// [path], relative to the served directory. Only these directories are
+// stat'ed, and a changed one is scanned again in place: its new children are
+// appended at the end of the index and the old ones are left dead. The cost
+// depends on the depth of the path and the size of the changed directories
+// rather than on the size of the tree. Dead entries are dropped once they make
+// up half of the index.
+int metaindex_refresh_path(metaindex *self, char const *dirname,
+                           char const *path);
+
+// Returns the index of the entry under the given path relative to the served
+// directory (empty path is the served directory itself), or -1 if there is no
+// such entry. Every path component is found with a binary search, so the cost
+// depends only on the depth of the path.
+ssize_t metaindex_find(metaindex const *self, char const *path);
+
+// Appends names of the regular files in the directory with index [dir_idx] to
+// the exbuffer. If [with_dirs] is set, subdirectories are appended as well,
+// with '/' at the end. The names are splited with '|'. -1 is returned when
+// malloc failes, otherwise 0.
+int metaindex_append_listing(metaindex const *self, size_t dir_idx,
+                             int with_dirs, exbuffer *ebufptr);
+
+#endif // METAINDEX_H
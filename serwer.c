@@ -1,32 +1,100 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/errqueue.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 
+#include "bufpool.h"
 #include "common.h"
 #include "exbuffer.h"
+#include "lz.h"
+#include "metaindex.h"
+#include "trace.h"
 
 #define USAGE_MSG                                                              \
-    "netstore-server <nazwa-katalogu-z-plikami> [<numer-portu-serwera>]"
+    "netstore-server [-i <plik-indeksu>] [-w [-f]] [-Z] [-G] "                 \
+    "[-l <sciezka-gniazda-lokalnego>] [-H <sciezka-gniazda-przekazania>] "     \
+    "<nazwa-katalogu-z-plikami> [<numer-portu-serwera>]"
+
+// Chunks smaller than that are copied even in the zerocopy mode, because
+// pinning pages and waiting for the completion costs more than the copy.
+#define ZEROCOPY_MIN_SIZE (128 * 1024)
+
+// That many mmaped chunks can wait for their zerocopy sends to complete. We
+// block on the completions only when all of them are taken.
+#define ZEROCOPY_MAX_PENDING (16)
+
+// Uploaded data is moved through the pipe of that size by splice, or through
+// the buffer of that size if splice can't be used.
+#define UPLOAD_BLOCK_SIZE (256 * 1024)
+
+// Messages sent over the handoff socket to the new server. Each one is a 16 bit
+// code, and all but the last one carry a listening socket.
+#define HANDOFF_END (0)
+#define HANDOFF_TCP_SOCKET (1)
+#define HANDOFF_LOCAL_SOCKET (2)
 
 typedef struct {
     char const *dirname;
+    int root_fd; // Served directory, requested paths are resolved from it.
+    int index_unsaved;      // Index has changed since it was saved.
     char const *port;
+    char const *index_path; // Can be null. Should be outside of dirname.
+    int allow_upload;       // Accept fileput requests.
+    int fsync_upload;       // Call fsync before responding to fileput.
+    int zerocopy;           // Send big chunks with MSG_ZEROCOPY.
+    int hugetlb;            // Use explicit huge pages for the buffers.
+    char const *local_path; // Path of the Unix domain socket. Can be null.
+    char const *handoff_path; // Where the next server asks for our sockets.
 } server_input_data;
 
+// Chunk sent with MSG_ZEROCOPY whose sends may have not completed yet.
+typedef struct {
+    uint8 *map;
+    size_t map_len;
+    uint32 end_seq; // Sends of the chunk are numbered below that.
+} zerocopy_pending;
+
+// Zerocopy sends are numbered by the kernel, and completions report ranges of
+// these numbers. The buffer of the send can be released only when its number
+// has been reported. TCP completes sends in order, so pending chunks are kept
+// in the ring, the oldest one first.
+typedef struct {
+    int enabled;
+    int copied; // Kernel had to copy the data anyway (e.g. on loopback).
+    uint32 next_seq;
+    uint32 completed;
+    zerocopy_pending pending[ZEROCOPY_MAX_PENDING];
+    size_t first_pending;
+    size_t num_pending;
+} zerocopy_state;
+
 typedef struct {
     char *content;
     size_t size;
     int error_code;
 } load_file_result;
 
+typedef struct {
+    FILE *fileptr;
+    size_t size;
+    int error_code;
+} open_file_result;
+
 typedef struct {
     uint32 addr_from;
     uint32 addr_len;
@@ -35,8 +103,7 @@ typedef struct {
 } chunk_request;
 
 void load_file_result_free(load_file_result *self) {
-    if (self->content)
-        free(self->content);
+    bufpool_release(self->content);
 }
 
 void chunk_request_free(chunk_request *self) {
@@ -46,74 +113,178 @@ void chunk_request_free(chunk_request *self) {
 
 static server_input_data parse_input(int argc, char **argv) {
     server_input_data retval;
-    if (argc < 2 || argc > 3)
+    retval.index_path = 0;
+    retval.allow_upload = 0;
+    retval.fsync_upload = 0;
+    retval.zerocopy = 0;
+    retval.hugetlb = 0;
+    retval.local_path = 0;
+    retval.handoff_path = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "i:wfZGl:H:")) != -1) {
+        if (opt == 'i')
+            retval.index_path = optarg;
+        else if (opt == 'w')
+            retval.allow_upload = 1;
+        else if (opt == 'f')
+            retval.fsync_upload = 1;
+        else if (opt == 'Z')
+            retval.zerocopy = 1;
+        else if (opt == 'G')
+            retval.hugetlb = 1;
+        else if (opt == 'l')
+            retval.local_path = optarg;
+        else if (opt == 'H')
+            retval.handoff_path = optarg;
+        else
+            bad_usage(USAGE_MSG);
+    }
+
+    int positional = argc - optind;
+    if (positional < 1 || positional > 2)
         bad_usage(USAGE_MSG);
 
-    retval.dirname = argv[1];
-    retval.port = (argc == 3 ? argv[2] : default_port);
+    retval.dirname = argv[optind];
+    retval.root_fd = -1;
+    retval.index_unsaved = 0;
+    retval.port = (positional == 2 ? argv[optind + 1] : default_port);
     return retval;
 }
 
-// Write to the exbuffer all filenames from the directory with the given
-// name. The names are splited with '|'.
-static char const *get_folder_filenames(char const *dirname,
-                                        exbuffer *ebufptr) {
-    size_t dirname_len = strlen(dirname);
-    char path_combined[dirname_len + 1 + NAME_MAX + 1];
-    strcpy(path_combined, dirname);
-    strcpy(&path_combined[dirname_len], "/");
-
-
-    // Dirent does not guarantee d_type so we use stat to select files only.
-    DIR *d;
-    if ((d = opendir(dirname))) {
-        struct dirent *dir;
-        int first_appended = 0;
-        while ((dir = readdir(d)) != NULL) {
-            struct stat filestat;
-            strcpy(&path_combined[dirname_len] + 1, dir->d_name);
-            stat(path_combined, &filestat);
-            if (S_ISREG(filestat.st_mode)) {
-                if (first_appended) {
-                    char separator[] = "|";
-                    CHECK(exbuffer_append(ebufptr, (uint8 *)separator,
-                                          sizeof(separator) - 1));
-                }
+// Writes the index to the index file if it has changed since it was saved.
+static void save_index(server_input_data *idata, metaindex *index) {
+    if (!idata->index_path || !idata->index_unsaved)
+        return;
 
-                first_appended = 1;
-                CHECK(exbuffer_append(ebufptr, (uint8 *)(dir->d_name),
-                                      strlen(dir->d_name)));
-            }
+    // Failing to save the index only makes the next startup slower.
+    if (metaindex_save(index, idata->index_path) == -1) {
+        fprintf(stderr, "WARNING: Could not save the index: %s\n",
+                strerror(errno));
+    }
+
+    idata->index_unsaved = 0;
+}
+
+// Rescans the directories on [path] that have changed since the last time, or
+// the whole tree if [path] is null. Only the whole tree refresh saves the
+// index, so that requests don't wait for it to be written. Changes made by the
+// requests are saved when the server exits.
+static void refresh_index(server_input_data *idata, metaindex *index,
+                          char const *path) {
+    int refresh_result =
+        (path ? metaindex_refresh_path(index, idata->dirname, path)
+              : metaindex_refresh(index, idata->dirname));
+    if (refresh_result == -1) {
+        if (errno == ENOENT || errno == ENOTDIR) {
+            fprintf(stderr, "ERROR: Directory does not exists\n");
+            errno = ENOTDIR;
         }
 
-        closedir(d);
-    }
-    else {
-        fprintf(stderr, "ERROR: Directory does not exists\n");
-        errno = ENOTDIR;
         FAILWITH_ERRNO();
     }
-    return 0;
+
+    if (refresh_result == 1) {
+        fprintf(stderr, "Directory has changed, index has %lu entries\n",
+                index->num_entries);
+        idata->index_unsaved = 1;
+    }
+
+    if (!path)
+        save_index(idata, index);
 }
 
-// Returns the size of the file under the given pointer.
-static size_t get_file_size(FILE *fileptr) {
-    size_t retval = 0;
-    CHECK(fseek(fileptr, 0, SEEK_END));
-    CHECK(retval = ftell(fileptr));
+// Checks that the path requested by the client is relative and can't point
+// outside of the served directory.
+static int is_safe_relative_path(char const *path) {
+    if (path[0] == '\0' || path[0] == '/')
+        return 0;
 
-    return retval;
+    while (*path) {
+        size_t component_len = strcspn(path, "/");
+        if (component_len == 0 ||
+            (component_len == 1 && path[0] == '.') ||
+            (component_len == 2 && path[0] == '.' && path[1] == '.')) {
+            return 0;
+        }
+
+        path += component_len;
+        if (*path == '/' && *++path == '\0')
+            return 0;
+    }
+
+    return 1;
 }
 
-// If error_code of the returned structure is 0, then content and size contains
-// chunk of file that has to be sent to the client, otherwise the error code
-// should be sent in the refuse message.
-static load_file_result try_load_requested_chunk(char const *dirname,
+// Opens the directory holding [path], which has to be accepted by
+// is_safe_relative_path. Path is walked from the served directory one
+// component at a time and no symlink is followed on the way, so the result is
+// always inside the served directory. [basename] is set to the last component
+// of the path. Returns the descriptor or -1 with errno set.
+static int open_parent_beneath(int root_fd, char const *path,
+                               char const **basename) {
+    int dir_fd = fcntl(root_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd == -1)
+        return -1;
+
+    for (;;) {
+        size_t component_len = strcspn(path, "/");
+        if (path[component_len] == '\0')
+            break;
+
+        if (component_len > NAME_MAX) {
+            close(dir_fd);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        char component[NAME_MAX + 1];
+        memcpy(component, path, component_len);
+        component[component_len] = '\0';
+
+        int next_fd = openat(dir_fd, component,
+                             O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        int saved_errno = errno;
+        close(dir_fd);
+        if (next_fd == -1) {
+            errno = saved_errno;
+            return -1;
+        }
+
+        dir_fd = next_fd;
+        path += component_len + 1;
+    }
+
+    *basename = path;
+    return dir_fd;
+}
+
+// Opens the file under [path] relative to the served directory, the same way
+// open_parent_beneath does, so symlinks are refused, including the last
+// component. Returns the descriptor or -1 with errno set.
+static int open_beneath(int root_fd, char const *path, int flags) {
+    char const *basename;
+    int dir_fd = open_parent_beneath(root_fd, path, &basename);
+    if (dir_fd == -1)
+        return -1;
+
+    int fd = openat(dir_fd, basename, flags | O_NOFOLLOW | O_CLOEXEC);
+    int saved_errno = errno;
+    close(dir_fd);
+    errno = saved_errno;
+    return fd;
+}
+
+// If error_code of the returned structure is 0, then fileptr is set to the
+// beginning of the requested chunk and size is the number of bytes that can be
+// read from it, otherwise the error code should be sent in the refuse
+// message. fileptr has to be closed by the caller.
+static open_file_result try_open_requested_chunk(int root_fd,
                                                  char const *name,
                                                  size_t addr_from,
                                                  size_t addr_len) {
-    load_file_result retval;
-    retval.content = 0;
+    open_file_result retval;
+    retval.fileptr = 0;
     retval.size = 0;
     retval.error_code = 0;
 
@@ -121,63 +292,93 @@ static load_file_result try_load_requested_chunk(char const *dirname,
         fprintf(stderr, "BAD REQUEST: Given length is 0\n");
         retval.error_code = FREQ_ERROR_ZERO_LEN;
     }
+    else if (!is_safe_relative_path(name)) {
+        fprintf(stderr, "BAD REQUEST: Path %s is not allowed\n", name);
+        retval.error_code = FREQ_ERROR_ON_SUCH_FILE;
+    }
     else {
-        size_t dirname_len = strlen(dirname);
-        size_t name_len = strlen(name);
-
-        // If dirname is absolute, we don't add ./ prefix.
-        char relative_prefix[] = "./";
-        char absolute_prefix[] = "";
-        char *prefix = (dirname[0] == '/' || dirname[0] == '~')
-                           ? absolute_prefix
-                           : relative_prefix;
-        size_t prefix_len = strlen(prefix);
-        char separator[] = "/";
-        size_t separator_len = 1;
-
-        char path_combined[prefix_len + dirname_len + 1 + name_len + 1];
-        strcpy(path_combined, prefix);
-        strcpy(&path_combined[prefix_len], dirname);
-        strcpy(&path_combined[prefix_len + dirname_len], separator);
-        strcpy(&path_combined[prefix_len + dirname_len + separator_len], name);
-
-        FILE *reqfile_ptr = fopen(path_combined, "r");
+        // Directories can be opened as well, so they are refused explicitly.
+        // O_NONBLOCK keeps us from hanging on a fifo, it does not change
+        // anything for regular files.
+        TRACE_BEGIN(fopen_start);
+        FILE *reqfile_ptr = 0;
+        int fd = open_beneath(root_fd, name, O_RDONLY | O_NONBLOCK);
+        struct stat filestat;
+        if (fd != -1 &&
+            (fstat(fd, &filestat) == -1 || !S_ISREG(filestat.st_mode) ||
+             !(reqfile_ptr = fdopen(fd, "r")))) {
+            close(fd);
+        }
+        TRACE_END(fopen_start, "fopen");
+
         if (!reqfile_ptr) {
-            fprintf(stderr, "BAD REQUEST: File %s does not exists\n",
-                    path_combined);
+            fprintf(stderr, "BAD REQUEST: File %s does not exists\n", name);
             retval.error_code = FREQ_ERROR_ON_SUCH_FILE;
         }
         else {
-            size_t reqfile_size = get_file_size(reqfile_ptr);
+            size_t reqfile_size = filestat.st_size;
             if (addr_from >= reqfile_size) {
                 fprintf(stderr, "BAD REQUEST: Address is out of range\n");
                 retval.error_code = FREQ_ERROR_OUT_OF_RANGE;
+                fclose(reqfile_ptr);
             }
             else {
+                TRACE_BEGIN(fseek_start);
                 CHECK(fseek(reqfile_ptr, addr_from, SEEK_SET));
-                retval.content = malloc(addr_len + 1);
-                if (!retval.content) {
-                    // Handle out of memory.
-                    errno = ENOMEM;
-                    FAILWITH_ERRNO();
-                }
-
-                retval.size = fread(retval.content, 1, addr_len, reqfile_ptr);
-                retval.content[retval.size] = 0;
+                TRACE_END(fseek_start, "fseek");
+                retval.fileptr = reqfile_ptr;
+                retval.size = (reqfile_size - addr_from < addr_len
+                                   ? reqfile_size - addr_from
+                                   : addr_len);
 
                 fprintf(stderr,
                         "REQUEST OK: File %s is available and in range\n",
-                        path_combined);
+                        name);
             }
+        }
+    }
+
+    return retval;
+}
 
-            fclose(reqfile_ptr);
+// If error_code of the returned structure is 0, then content and size contains
+// chunk of file that has to be sent to the client, otherwise the error code
+// should be sent in the refuse message.
+static load_file_result try_load_requested_chunk(int root_fd,
+                                                 char const *name,
+                                                 size_t addr_from,
+                                                 size_t addr_len) {
+    load_file_result retval;
+    retval.content = 0;
+    retval.size = 0;
+    retval.error_code = 0;
+
+    open_file_result open_result =
+        try_open_requested_chunk(root_fd, name, addr_from, addr_len);
+    if (open_result.error_code != 0) {
+        retval.error_code = open_result.error_code;
+    }
+    else {
+        retval.content = bufpool_alloc(open_result.size);
+        if (!retval.content) {
+            // Handle out of memory.
+            errno = ENOMEM;
+            FAILWITH_ERRNO();
         }
+
+        TRACE_BEGIN(fread_start);
+        retval.size =
+            fread(retval.content, 1, open_result.size, open_result.fileptr);
+        TRACE_END(fread_start, "fread");
+
+        fclose(open_result.fileptr);
     }
 
     return retval;
 }
 
-static int snd_filenames(int msg_sock, char const *dirname) {
+static int snd_filenames(int msg_sock, server_input_data *idata,
+                         metaindex *index) {
     int16 num_to_send = htons(PROT_RESP_FILELIST);
     int32 sizeof_filenames = 0; // We dont know yet how much space.
     exbuffer ebuf;
@@ -185,8 +386,9 @@ static int snd_filenames(int msg_sock, char const *dirname) {
     CHECK(exbuffer_append(&ebuf, (uint8 *)(&num_to_send), 2));
     CHECK(exbuffer_append(&ebuf, (uint8 *)(&sizeof_filenames), 4));
 
-    // This will write finenames to the buffer.
-    get_folder_filenames(dirname, &ebuf);
+    // Directory is scanned only if it has changed since the last request.
+    refresh_index(idata, index, "");
+    CHECK(metaindex_append_listing(index, 0, 0, &ebuf));
 
     // Now we know how much space filenames really take, so we override
     // previously skipped bytes in the msg.
@@ -200,13 +402,67 @@ static int snd_filenames(int msg_sock, char const *dirname) {
     return snd_error;
 }
 
-static int snd_filechunk(int msg_sock, char const *dirname,
-                         chunk_request *request) {
+static int snd_dirlist(int msg_sock, server_input_data *idata,
+                       metaindex *index, char const *path) {
+    ssize_t dir_idx = -1;
+    if (path[0] == '\0' || is_safe_relative_path(path)) {
+        // Only the directories on the path are checked for changes.
+        refresh_index(idata, index, path);
+        dir_idx = metaindex_find(index, path);
+    }
+
+    // Index never goes through symlinks, but the directory could have been
+    // replaced with one since it was scanned.
+    if (dir_idx > 0) {
+        int dir_fd = open_beneath(idata->root_fd, path, O_PATH | O_DIRECTORY);
+        if (dir_fd == -1)
+            dir_idx = -1;
+        else
+            close(dir_fd);
+    }
+
+    if (dir_idx == -1 || index->entries[dir_idx].type != METAINDEX_TYPE_DIR) {
+        fprintf(stderr, "BAD REQUEST: Directory %s does not exists\n", path);
+
+        uint8 msg[6];
+        int16 msg_code = htons(PROT_RESP_DIRLIST_ERROR);
+        int32 msg_refuse_reason = htonl(FREQ_ERROR_ON_SUCH_FILE);
+        memcpy(msg, (uint8 *)(&msg_code), 2);
+        memcpy(msg + 2, (uint8 *)(&msg_refuse_reason), 4);
+        return snd_total(msg_sock, msg, 6);
+    }
+
+    int16 num_to_send = htons(PROT_RESP_DIRLIST);
+    int32 sizeof_filenames = 0;
     exbuffer ebuf;
     CHECK(exbuffer_init(&ebuf));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)(&num_to_send), 2));
+    CHECK(exbuffer_append(&ebuf, (uint8 *)(&sizeof_filenames), 4));
+    CHECK(metaindex_append_listing(index, dir_idx, 1, &ebuf));
+
+    sizeof_filenames = htonl(ebuf.size - 6);
+    memcpy(ebuf.data + 2, (uint8 *)(&sizeof_filenames), 4);
+
+    int snd_error;
+    snd_error = snd_total(msg_sock, ebuf.data, ebuf.size);
+    exbuffer_free(&ebuf);
+
+    return snd_error;
+}
+
+static int snd_filechunk_refuse(int msg_sock, int error_code) {
+    uint8 msg[6];
+    int16 msg_code = htons(PROT_RESP_FILECHUNK_ERROR);
+    int32 msg_refuse_reason = htonl(error_code);
+    memcpy(msg, (uint8 *)(&msg_code), 2);
+    memcpy(msg + 2, (uint8 *)(&msg_refuse_reason), 4);
+
+    return snd_total(msg_sock, msg, 6);
+}
 
+static int snd_filechunk(int msg_sock, int root_fd, chunk_request *request) {
     load_file_result load_result = try_load_requested_chunk(
-        dirname, request->filename, request->addr_from, request->addr_len);
+        root_fd, request->filename, request->addr_from, request->addr_len);
 
     int16 msg_code;
     int32 msg_filelen_or_refuse_reason;
@@ -221,22 +477,318 @@ static int snd_filechunk(int msg_sock, char const *dirname,
         msg_filelen_or_refuse_reason = htonl(load_result.error_code);
     }
 
-    CHECK(exbuffer_append(&ebuf, (uint8 *)(&msg_code), 2));
-    CHECK(exbuffer_append(&ebuf, (uint8 *)(&msg_filelen_or_refuse_reason), 4));
-    // load_result.size will be zero on error.
-    CHECK(
-        exbuffer_append(&ebuf, (uint8 *)load_result.content, load_result.size));
+    uint8 header[6];
+    memcpy(header, (uint8 *)(&msg_code), 2);
+    memcpy(header + 2, (uint8 *)(&msg_filelen_or_refuse_reason), 4);
 
+    // Chunk is sent straight from the buffer it was read to, it is not copied
+    // after the header. load_result.size will be zero on error.
     int snd_error;
-    snd_error = snd_total(msg_sock, ebuf.data, ebuf.size);
+    TRACE_BEGIN(snd_start);
+    snd_error = snd_total(msg_sock, header, 6);
+    if (snd_error == 0 && load_result.size > 0) {
+        snd_error = snd_total(msg_sock, (uint8 *)load_result.content,
+                              load_result.size);
+    }
+    TRACE_END(snd_start, "snd_total");
 
-    exbuffer_free(&ebuf);
     load_file_result_free(&load_result);
 
     // Return result of snd_total, as it returns 0 on success, and -1 on fail.
     return snd_error;
 }
 
+// Same as snd_filechunk, but the chunk is read and sent in frames of at most
+// LZ_FRAME_SIZE bytes and every frame that compresses is sent compressed.
+static int snd_filechunk_lz(int msg_sock, int root_fd,
+                            chunk_request *request) {
+    open_file_result open_result = try_open_requested_chunk(
+        root_fd, request->filename, request->addr_from, request->addr_len);
+
+    if (open_result.error_code != 0)
+        return snd_filechunk_refuse(msg_sock, open_result.error_code);
+
+    int16 msg_code = htons(PROT_RESP_FILECHUNK_LZ_OK);
+    int32 msg_filelen = htonl(open_result.size);
+    uint8 header[6];
+    memcpy(header, (uint8 *)(&msg_code), 2);
+    memcpy(header + 2, (uint8 *)(&msg_filelen), 4);
+
+    uint8 *raw = bufpool_alloc(LZ_FRAME_SIZE);
+    uint8 *frame = bufpool_alloc(LZ_FRAME_HEADER_SIZE + LZ_FRAME_SIZE);
+    if (!raw || !frame) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    int snd_error = snd_total(msg_sock, header, 6);
+    size_t remained = open_result.size;
+    size_t total_compressed = 0;
+    while (snd_error == 0 && remained > 0) {
+        size_t raw_len = (remained < LZ_FRAME_SIZE ? remained : LZ_FRAME_SIZE);
+        TRACE_BEGIN(fread_start);
+        size_t red = fread(raw, 1, raw_len, open_result.fileptr);
+        TRACE_END(fread_start, "fread");
+        if (red != raw_len) {
+            // File was truncated after we've promised the client its size, so
+            // we can't keep the contract. The connection has to be dropped.
+            fprintf(stderr, "ERROR: File %s has shrunk while being sent\n",
+                    request->filename);
+            errno = EIO;
+            snd_error = -1;
+            break;
+        }
+
+        // Compressed data has to be strictly shorter, so that the client can
+        // tell raw frames by equal lengths.
+        uint8 *payload = frame + LZ_FRAME_HEADER_SIZE;
+        TRACE_BEGIN(compress_start);
+        size_t payload_len = lz_compress(raw, raw_len, payload, raw_len - 1);
+        TRACE_END(compress_start, "lz_compress");
+        if (payload_len == 0) {
+            memcpy(payload, raw, raw_len);
+            payload_len = raw_len;
+        }
+
+        int32 msg_raw_len = htonl(raw_len);
+        int32 msg_payload_len = htonl(payload_len);
+        memcpy(frame, (uint8 *)(&msg_raw_len), 4);
+        memcpy(frame + 4, (uint8 *)(&msg_payload_len), 4);
+
+        TRACE_BEGIN(snd_start);
+        snd_error =
+            snd_total(msg_sock, frame, LZ_FRAME_HEADER_SIZE + payload_len);
+        TRACE_END(snd_start, "snd_total");
+        remained -= raw_len;
+        total_compressed += payload_len;
+    }
+
+    if (snd_error == 0) {
+        fprintf(stderr, "Sent %lu bytes of file as %lu bytes\n",
+                open_result.size, total_compressed);
+    }
+
+    bufpool_release(raw);
+    bufpool_release(frame);
+    fclose(open_result.fileptr);
+
+    return snd_error;
+}
+
+// Unmaps the pending chunks whose sends have all completed.
+static void release_zerocopy_chunks(zerocopy_state *zc) {
+    while (zc->num_pending > 0) {
+        zerocopy_pending *oldest = &zc->pending[zc->first_pending];
+        if ((int32)(zc->completed - oldest->end_seq) < 0)
+            break;
+
+        munmap(oldest->map, oldest->map_len);
+        zc->first_pending = (zc->first_pending + 1) % ZEROCOPY_MAX_PENDING;
+        zc->num_pending--;
+    }
+}
+
+// Unmaps all pending chunks, whether their sends have completed or not. Used
+// once the connection is closed, the kernel keeps its own references to the
+// pages that are still being sent.
+static void drop_zerocopy_chunks(zerocopy_state *zc) {
+    for (; zc->num_pending > 0; zc->num_pending--) {
+        zerocopy_pending *oldest = &zc->pending[zc->first_pending];
+        munmap(oldest->map, oldest->map_len);
+        zc->first_pending = (zc->first_pending + 1) % ZEROCOPY_MAX_PENDING;
+    }
+}
+
+// Reads all zerocopy completions from the socket error queue and releases the
+// chunks that are done. Blocks only while more than [max_pending] chunks are
+// pending. There is no timeout, as a slow client is not an error, but we stop
+// waiting when the connection is broken. Returns 0 on success or -1 on failure.
+static int reap_zerocopy_completions(int msg_sock, zerocopy_state *zc,
+                                     size_t max_pending) {
+    int broken = 0;
+    for (;;) {
+        release_zerocopy_chunks(zc);
+        if (zc->completed == zc->next_seq)
+            return 0;
+
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(msg_sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return -1;
+            if (zc->num_pending <= max_pending)
+                return 0;
+
+            // Poll reported an error or a hangup, but there is no completion
+            // to read, so none will ever come.
+            if (broken) {
+                errno = EPIPE;
+                return -1;
+            }
+
+            // Error queue is always polled, so no events have to be given.
+            struct pollfd pfd;
+            pfd.fd = msg_sock;
+            pfd.events = 0;
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                return -1;
+
+            broken = ((pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+            continue;
+        }
+
+        broken = 0;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+             cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP &&
+                   cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 &&
+                   cmsg->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+
+            struct sock_extended_err *serr =
+                (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            // ee_info and ee_data are the first and the last completed send.
+            zc->completed += serr->ee_data - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->copied = 1;
+        }
+    }
+
+    return 0;
+}
+
+// Sends the buffer with MSG_ZEROCOPY. Pages of the buffer are sent directly
+// from the memory, so the buffer can't be changed or released until
+// reap_zerocopy_completions reports its sends, which are numbered below
+// zc->next_seq once this returns. Returns 0 on success or -1 on failure.
+static int snd_total_zerocopy(int msg_sock, zerocopy_state *zc, uint8 *buffer,
+                              size_t count) {
+    while (count > 0) {
+        ssize_t sent = send(msg_sock, buffer, count, MSG_ZEROCOPY);
+        if (sent == -1 && errno == ENOBUFS) {
+            // Too many pages are pinned, so we release some of them and send
+            // the rest with a copy if that did not help.
+            if (reap_zerocopy_completions(msg_sock, zc,
+                                          ZEROCOPY_MAX_PENDING) == -1) {
+                return -1;
+            }
+
+            sent = send(msg_sock, buffer, count, MSG_ZEROCOPY);
+            if (sent == -1 && errno == ENOBUFS)
+                return snd_total(msg_sock, buffer, count);
+        }
+
+        if (sent == -1 && errno == EINTR)
+            continue;
+        if (sent == -1)
+            return -1;
+
+        zc->next_seq++;
+        buffer += sent;
+        count -= sent;
+    }
+
+    return 0;
+}
+
+// Same as snd_filechunk, but the file is mmaped and sent with MSG_ZEROCOPY,
+// so its data is not copied to the socket buffers. Small chunks are copied,
+// as that is faster for them. The mapping stays pending in [zc] until the
+// kernel is done with it, so we don't wait for the client here.
+static int snd_filechunk_zerocopy(int msg_sock, int root_fd,
+                                  chunk_request *request, zerocopy_state *zc) {
+    open_file_result open_result = try_open_requested_chunk(
+        root_fd, request->filename, request->addr_from, request->addr_len);
+
+    if (open_result.error_code != 0)
+        return snd_filechunk_refuse(msg_sock, open_result.error_code);
+
+    int16 msg_code = htons(PROT_RESP_FILECHUNK_OK);
+    int32 msg_filelen = htonl(open_result.size);
+    uint8 header[6];
+    memcpy(header, (uint8 *)(&msg_code), 2);
+    memcpy(header + 2, (uint8 *)(&msg_filelen), 4);
+
+    // mmap requires the offset to be aligned to the page.
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t map_from = request->addr_from & ~(page_size - 1);
+    size_t map_len = open_result.size + (request->addr_from - map_from);
+    uint8 *map = MAP_FAILED;
+    int snd_error = 0;
+    if (open_result.size >= ZEROCOPY_MIN_SIZE) {
+        // Makes room for the chunk, waiting only if the ring is full.
+        snd_error = reap_zerocopy_completions(msg_sock, zc,
+                                              ZEROCOPY_MAX_PENDING - 1);
+        if (snd_error == 0) {
+            map = mmap(0, map_len, PROT_READ, MAP_SHARED,
+                       fileno(open_result.fileptr), map_from);
+        }
+    }
+
+    if (snd_error == 0)
+        snd_error = snd_total(msg_sock, header, 6);
+    if (snd_error == 0 && map != MAP_FAILED) {
+        TRACE_BEGIN(snd_start);
+        snd_error = snd_total_zerocopy(msg_sock, zc,
+                                       map + (request->addr_from - map_from),
+                                       open_result.size);
+        TRACE_END(snd_start, "snd_total_zerocopy");
+
+        // Even if sending failed, pages may still be used by the kernel.
+        size_t slot = (zc->first_pending + zc->num_pending++) %
+                      ZEROCOPY_MAX_PENDING;
+        zc->pending[slot].map = map;
+        zc->pending[slot].map_len = map_len;
+        zc->pending[slot].end_seq = zc->next_seq;
+        map = MAP_FAILED;
+    }
+    else if (snd_error == 0) {
+        uint8 *content = bufpool_alloc(open_result.size);
+        if (!content) {
+            errno = ENOMEM;
+            FAILWITH_ERRNO();
+        }
+
+        TRACE_BEGIN(fread_start);
+        size_t red = fread(content, 1, open_result.size, open_result.fileptr);
+        TRACE_END(fread_start, "fread");
+        if (red != open_result.size) {
+            errno = EIO;
+            snd_error = -1;
+        }
+        else {
+            TRACE_BEGIN(snd_start);
+            snd_error = snd_total(msg_sock, content, open_result.size);
+            TRACE_END(snd_start, "snd_total");
+        }
+
+        bufpool_release(content);
+    }
+
+    if (map != MAP_FAILED)
+        munmap(map, map_len);
+    fclose(open_result.fileptr);
+
+    if (zc->copied) {
+        fprintf(stderr, "Kernel copies zerocopy sends on this connection, "
+                        "zerocopy is disabled for it\n");
+        zc->enabled = 0;
+    }
+
+    return snd_error;
+}
+
 static int rcv_chunk_request(int msg_sock, chunk_request *req) {
     uint8 header_buffer[10];
 
@@ -261,6 +813,389 @@ static int rcv_chunk_request(int msg_sock, chunk_request *req) {
     return 0;
 }
 
+// Receives the path of the dirlist (or filefd) request. Returned string has to
+// be freed by the caller. Returns 0 on success or -1 on failure.
+static int rcv_dirlist_request(int msg_sock, char **path) {
+    uint8 header_buffer[2];
+    if (rcv_total(msg_sock, header_buffer, 2) == -1)
+        return -1;
+
+    uint16 path_len = unaligned_load_int16be(header_buffer);
+    *path = malloc(path_len + 1);
+    if (!*path) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    if (rcv_total(msg_sock, (uint8 *)*path, path_len) == -1) {
+        free(*path);
+        return -1;
+    }
+
+    (*path)[path_len] = '\0';
+    return 0;
+}
+
+// Reads [len] bytes from the socket and throws them away, so that the next
+// request can be read. Returns 0 on success or -1 on failure.
+static int drain_socket(int msg_sock, size_t len) {
+    uint8 buffer[4096];
+    while (len > 0) {
+        size_t part = (len < sizeof(buffer) ? len : sizeof(buffer));
+        if (rcv_total(msg_sock, buffer, part) == -1)
+            return -1;
+
+        len -= part;
+    }
+
+    return 0;
+}
+
+// Moves [len] bytes from the socket to the file, starting at [offset]. Returns
+// 0 on success, -1 if the socket has failed and -2 if the file could not be
+// written. In the last case [received] is set to the number of bytes taken from
+// the socket, so that the rest can be drained.
+static int rcv_to_file_with_read(int msg_sock, int fd, off_t offset,
+                                 size_t len, size_t *received) {
+    uint8 *buffer = bufpool_alloc(UPLOAD_BLOCK_SIZE);
+    if (!buffer) {
+        errno = ENOMEM;
+        FAILWITH_ERRNO();
+    }
+
+    int retval = 0;
+    *received = 0;
+    while (retval == 0 && *received < len) {
+        size_t part = len - *received;
+        if (part > UPLOAD_BLOCK_SIZE)
+            part = UPLOAD_BLOCK_SIZE;
+
+        if (rcv_total(msg_sock, buffer, part) == -1) {
+            retval = -1;
+            break;
+        }
+
+        *received += part;
+        size_t written = 0;
+        while (written < part) {
+            ssize_t result =
+                pwrite(fd, buffer + written, part - written, offset + written);
+            if (result <= 0) {
+                retval = -2;
+                break;
+            }
+
+            written += result;
+        }
+
+        offset += part;
+    }
+
+    bufpool_release(buffer);
+    return retval;
+}
+
+// Same as rcv_to_file_with_read, but the data is moved with splice, so it is
+// never copied to the user space. Falls back to read and pwrite if the socket
+// can't be spliced.
+static int rcv_to_file(int msg_sock, int fd, off_t offset, size_t len,
+                       size_t *received) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1)
+        return rcv_to_file_with_read(msg_sock, fd, offset, len, received);
+
+    // Bigger pipe means less syscalls. It is fine if that fails.
+    fcntl(pipefd[1], F_SETPIPE_SZ, UPLOAD_BLOCK_SIZE);
+
+    int retval = 0;
+    *received = 0;
+    while (retval == 0 && *received < len) {
+        size_t part = len - *received;
+        if (part > UPLOAD_BLOCK_SIZE)
+            part = UPLOAD_BLOCK_SIZE;
+
+        ssize_t in_pipe = splice(msg_sock, 0, pipefd[1], 0, part,
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe == -1 && *received == 0 &&
+            (errno == EINVAL || errno == ENOSYS)) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return rcv_to_file_with_read(msg_sock, fd, offset, len, received);
+        }
+        else if (in_pipe <= 0) {
+            if (in_pipe == 0)
+                errno = ESTRPIPE;
+            retval = -1;
+            break;
+        }
+
+        *received += in_pipe;
+        while (in_pipe > 0) {
+            ssize_t written =
+                splice(pipefd[0], 0, fd, &offset, in_pipe, SPLICE_F_MOVE);
+            if (written <= 0) {
+                retval = -2;
+                break;
+            }
+
+            in_pipe -= written;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return retval;
+}
+
+// Same as mkstemp, but the file is created in the directory [dir_fd] and
+// symlinks are not followed. [name] has to end with XXXXXX, which is replaced
+// with random characters. Returns the descriptor or -1 with errno set.
+static int mkstempat(int dir_fd, char *name) {
+    static char const letters[] =
+        "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    size_t name_len = strlen(name);
+    assert(name_len >= 6);
+
+    for (int attempt = 0; attempt != 100; ++attempt) {
+        uint8 random[6];
+        if (getrandom(random, sizeof(random), 0) != sizeof(random))
+            return -1;
+
+        for (size_t i = 0; i != sizeof(random); ++i)
+            name[name_len - 6 + i] = letters[random[i] % (sizeof(letters) - 1)];
+
+        int fd = openat(dir_fd, name,
+                        O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                        0600);
+        if (fd != -1 || errno != EEXIST)
+            return fd;
+    }
+
+    errno = EEXIST;
+    return -1;
+}
+
+static int snd_fileput_response(int msg_sock, int16 code, int32 value) {
+    uint8 msg[6];
+    int16 msg_code = htons(code);
+    int32 msg_value = htonl(value);
+    memcpy(msg, (uint8 *)(&msg_code), 2);
+    memcpy(msg + 2, (uint8 *)(&msg_value), 4);
+
+    return snd_total(msg_sock, msg, 6);
+}
+
+// Handles the fileput of zero bytes, which ends the upload of the whole file.
+// The file is cut at the address of the request, so that nothing is left from
+// its previous, longer contents. Returns 0 on success or -1 if the connection
+// has to be dropped.
+static int end_fileput(int msg_sock, server_input_data *idata,
+                       chunk_request *request) {
+    struct stat filestat;
+    int fd = open_beneath(idata->root_fd, request->filename,
+                          O_WRONLY | O_NONBLOCK);
+    if (fd != -1 &&
+        (fstat(fd, &filestat) == -1 || !S_ISREG(filestat.st_mode))) {
+        close(fd);
+        fd = -1;
+        errno = EISDIR;
+    }
+
+    if (fd == -1) {
+        fprintf(stderr, "BAD REQUEST: Can't write to %s: %s\n",
+                request->filename, strerror(errno));
+        return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_ERROR,
+                                    FREQ_ERROR_ON_SUCH_FILE);
+    }
+
+    int failed = (ftruncate(fd, request->addr_from) == -1 ||
+                  (idata->fsync_upload && fsync(fd) == -1));
+    if (close(fd) == -1)
+        failed = 1;
+
+    if (failed) {
+        fprintf(stderr, "ERROR: Truncating %s failed: %s\n",
+                request->filename, strerror(errno));
+        return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_ERROR,
+                                    FREQ_ERROR_WRITE_FAILED);
+    }
+
+    fprintf(stderr, "REQUEST OK: File %s ends at %u bytes\n",
+            request->filename, request->addr_from);
+    return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_OK, 0);
+}
+
+// Writes the data following the request to the file and sends the response.
+// Existing files are written in place. New files are written to a temporary
+// file in the same directory, which is renamed when all data is written, so
+// that nobody can see a partially uploaded file. Request of zero bytes ends
+// the upload, see end_fileput. Returns 0 on success or -1 if the connection
+// has to be dropped.
+static int rcv_fileput(int msg_sock, server_input_data *idata,
+                       chunk_request *request) {
+    int refuse_reason = 0;
+    if (!idata->allow_upload) {
+        fprintf(stderr, "BAD REQUEST: Uploads are not allowed\n");
+        refuse_reason = FREQ_ERROR_NOT_PERMITTED;
+    }
+    else if (!is_safe_relative_path(request->filename)) {
+        fprintf(stderr, "BAD REQUEST: Path %s is not allowed\n",
+                request->filename);
+        refuse_reason = FREQ_ERROR_ON_SUCH_FILE;
+    }
+
+    if (refuse_reason != 0) {
+        if (drain_socket(msg_sock, request->addr_len) == -1)
+            return -1;
+
+        return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_ERROR,
+                                    refuse_reason);
+    }
+
+    if (request->addr_len == 0)
+        return end_fileput(msg_sock, idata, request);
+
+    // Everything is done relative to the directory holding the file, which is
+    // resolved without following symlinks, so that uploads can't write
+    // outside of the served directory.
+    char const *basename;
+    int dir_fd =
+        open_parent_beneath(idata->root_fd, request->filename, &basename);
+
+    char tmp_name[NAME_MAX + 1];
+    int is_new = 0;
+    int fd = -1;
+    struct stat filestat;
+    if (dir_fd != -1) {
+        // O_NONBLOCK makes opening a fifo fail instead of waiting for reader.
+        fd = openat(dir_fd, basename,
+                    O_WRONLY | O_NONBLOCK | O_NOFOLLOW | O_CLOEXEC);
+    }
+
+    if (fd != -1 &&
+        (fstat(fd, &filestat) == -1 || !S_ISREG(filestat.st_mode))) {
+        close(fd);
+        fd = -1;
+        errno = EISDIR;
+    }
+    else if (fd == -1 && dir_fd != -1 && errno == ENOENT) {
+        // Temporary file is hidden and placed next to the target, so that
+        // rename does not cross file systems.
+        is_new = 1;
+        if (snprintf(tmp_name, sizeof(tmp_name), ".%s.netstore-XXXXXX",
+                     basename) >= (int)sizeof(tmp_name)) {
+            errno = ENAMETOOLONG;
+        }
+        else if ((fd = mkstempat(dir_fd, tmp_name)) != -1) {
+            fchmod(fd, 0644);
+        }
+    }
+
+    if (fd == -1) {
+        fprintf(stderr, "BAD REQUEST: Can't write to %s: %s\n",
+                request->filename, strerror(errno));
+        if (dir_fd != -1)
+            close(dir_fd);
+        if (drain_socket(msg_sock, request->addr_len) == -1)
+            return -1;
+
+        return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_ERROR,
+                                    FREQ_ERROR_ON_SUCH_FILE);
+    }
+
+    // Reserving the space up front avoids fragmentation. The file size is not
+    // changed, so a failed upload does not leave zeros at the end of the file.
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, request->addr_from, request->addr_len);
+
+    size_t received;
+    int rcv_result =
+        rcv_to_file(msg_sock, fd, request->addr_from, request->addr_len,
+                    &received);
+    if (rcv_result == 0 && idata->fsync_upload && fsync(fd) == -1)
+        rcv_result = -2;
+
+    if (close(fd) == -1 && rcv_result == 0)
+        rcv_result = -2;
+
+    if (rcv_result == 0 && is_new &&
+        renameat(dir_fd, tmp_name, dir_fd, basename) == -1) {
+        rcv_result = -2;
+    }
+
+    if (rcv_result != 0 && is_new)
+        unlinkat(dir_fd, tmp_name, 0);
+
+    close(dir_fd);
+    if (rcv_result == -1)
+        return -1;
+
+    if (rcv_result == -2) {
+        fprintf(stderr, "ERROR: Writing to %s failed: %s\n", request->filename,
+                strerror(errno));
+        if (drain_socket(msg_sock, request->addr_len - received) == -1)
+            return -1;
+
+        return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_ERROR,
+                                    FREQ_ERROR_WRITE_FAILED);
+    }
+
+    fprintf(stderr, "REQUEST OK: Wrote %u bytes to %s\n", request->addr_len,
+            request->filename);
+    return snd_fileput_response(msg_sock, PROT_RESP_FILEPUT_OK,
+                                request->addr_len);
+}
+
+// Opens the requested file and passes its descriptor to the client, so that
+// the client can read it without going through the socket at all. This is
+// allowed only for local clients. Returns 0 on success or -1 if the connection
+// has to be dropped.
+static int snd_filefd(int msg_sock, int root_fd, char const *name,
+                      int is_local) {
+    int refuse_reason = 0;
+    int fd = -1;
+    if (!is_local) {
+        fprintf(stderr, "BAD REQUEST: Filefd is allowed only locally\n");
+        refuse_reason = FREQ_ERROR_NOT_PERMITTED;
+    }
+    else if (!is_safe_relative_path(name)) {
+        fprintf(stderr, "BAD REQUEST: Path %s is not allowed\n", name);
+        refuse_reason = FREQ_ERROR_ON_SUCH_FILE;
+    }
+    else {
+        // Opened without following symlinks, as the client gets the
+        // descriptor itself. O_NONBLOCK keeps a fifo from blocking us, it is
+        // cleared before the descriptor is passed.
+        struct stat filestat;
+        fd = open_beneath(root_fd, name, O_RDONLY | O_NONBLOCK);
+        if (fd != -1 &&
+            (fstat(fd, &filestat) == -1 || !S_ISREG(filestat.st_mode) ||
+             fcntl(fd, F_SETFL, 0) == -1)) {
+            close(fd);
+            fd = -1;
+        }
+
+        if (fd == -1) {
+            fprintf(stderr, "BAD REQUEST: File %s does not exists\n", name);
+            refuse_reason = FREQ_ERROR_ON_SUCH_FILE;
+        }
+    }
+
+    uint8 msg[6];
+    int16 msg_code =
+        htons(refuse_reason ? PROT_RESP_FILEFD_ERROR : PROT_RESP_FILEFD_OK);
+    int32 msg_refuse_reason = htonl(refuse_reason);
+    memcpy(msg, (uint8 *)(&msg_code), 2);
+    memcpy(msg + 2, (uint8 *)(&msg_refuse_reason), 4);
+
+    if (fd == -1)
+        return snd_total(msg_sock, msg, 6);
+
+    // Client gets its own copy of the descriptor, so ours can be closed.
+    int snd_error = snd_total_with_fd(msg_sock, msg, 6, fd);
+    close(fd);
+    return snd_error;
+}
+
 static int init_and_bind(server_input_data *idata) {
     int sock;
     struct sockaddr_in server_address;
@@ -283,6 +1218,160 @@ static int init_and_bind(server_input_data *idata) {
     return sock;
 }
 
+// Same as init_and_bind, but the socket is a Unix domain socket, bound to the
+// given path. Stale socket file left by the previous run is removed.
+static int init_and_bind_unix(char const *path) {
+    int sock;
+    struct sockaddr_un server_address;
+    if (strlen(path) >= sizeof(server_address.sun_path)) {
+        errno = ENAMETOOLONG;
+        FAILWITH_ERRNO();
+    }
+
+    CHECK((sock = socket(AF_UNIX, SOCK_STREAM, 0)));
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sun_family = AF_UNIX;
+    strcpy(server_address.sun_path, path);
+    if (unlink(path) == -1 && errno != ENOENT)
+        FAILWITH_ERRNO();
+
+    CHECK(
+        bind(sock, (struct sockaddr *)&server_address, sizeof(server_address)));
+    CHECK(listen(sock, SOMAXCONN));
+
+    return sock;
+}
+
+// Asks the server running on the handoff socket for its listening sockets. They
+// are shared with the old server until it closes them, so clients are never
+// refused. Returns 1 if the sockets have been taken over, 0 if there is no
+// server to take them from.
+static int take_over(char const *handoff_path, int *sock, int *local_sock) {
+    int handoff_sock;
+    struct sockaddr_un server_address;
+    if (strlen(handoff_path) >= sizeof(server_address.sun_path)) {
+        errno = ENAMETOOLONG;
+        FAILWITH_ERRNO();
+    }
+
+    CHECK((handoff_sock = socket(AF_UNIX, SOCK_STREAM, 0)));
+
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sun_family = AF_UNIX;
+    strcpy(server_address.sun_path, handoff_path);
+    if (connect(handoff_sock, (struct sockaddr *)&server_address,
+                sizeof(server_address)) == -1) {
+        // Socket file is missing or left by a server that is gone.
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            CHECK(close(handoff_sock));
+            return 0;
+        }
+
+        FAILWITH_ERRNO();
+    }
+
+    // Old server answers when it is done with the request it is serving.
+    fprintf(stderr, "Waiting for the running server to hand over\n");
+    for (;;) {
+        uint8 buffer[2];
+        int fd;
+        CHECK(rcv_total_with_fd(handoff_sock, buffer, 2, &fd));
+
+        uint16 code = unaligned_load_int16be(buffer);
+        if (code == HANDOFF_END)
+            break;
+
+        if (fd == -1) {
+            errno = EBADMSG;
+            FAILWITH_ERRNO();
+        }
+
+        if (code == HANDOFF_TCP_SOCKET)
+            *sock = fd;
+        else if (code == HANDOFF_LOCAL_SOCKET)
+            *local_sock = fd;
+        else
+            CHECK(close(fd));
+    }
+
+    CHECK(close(handoff_sock));
+    if (*sock == -1) {
+        errno = EBADMSG;
+        FAILWITH_ERRNO();
+    }
+
+    return 1;
+}
+
+static int snd_handoff_message(int sock, uint16 code, int fd) {
+    uint8 msg[2];
+    int16 msg_code = htons(code);
+    memcpy(msg, (uint8 *)(&msg_code), 2);
+
+    return (fd == -1 ? snd_total(sock, msg, 2)
+                     : snd_total_with_fd(sock, msg, 2, fd));
+}
+
+// Gives the listening sockets to the new server waiting on the handoff socket
+// and closes ours, so that from now on only the new server accepts clients.
+// The connection that is being served is not affected. Returns -1 and keeps
+// the sockets if the new server could not get them.
+static int hand_over(int *handoff_sock, int *sock, int *local_sock) {
+    int successor;
+    if ((successor = accept(*handoff_sock, 0, 0)) == -1)
+        return -1;
+
+    if (snd_handoff_message(successor, HANDOFF_TCP_SOCKET, *sock) == -1 ||
+        (*local_sock != -1 &&
+         snd_handoff_message(successor, HANDOFF_LOCAL_SOCKET, *local_sock) ==
+             -1) ||
+        snd_handoff_message(successor, HANDOFF_END, -1) == -1) {
+        close(successor);
+        return -1;
+    }
+
+    close(successor);
+    CHECK(close(*handoff_sock));
+    CHECK(close(*sock));
+    if (*local_sock != -1)
+        CHECK(close(*local_sock));
+
+    *handoff_sock = -1;
+    *sock = -1;
+    *local_sock = -1;
+    fprintf(stderr, "Listening sockets handed over to the new server\n");
+    return 0;
+}
+
+// Waits for the next request on [msg_sock], handing the listening sockets
+// over if the new server asks for them in the meantime. Returns -1 on failure.
+static int wait_for_request(int msg_sock, int *handoff_sock, int *sock,
+                            int *local_sock) {
+    while (*handoff_sock != -1) {
+        struct pollfd fds[2];
+        fds[0].fd = msg_sock;
+        fds[0].events = POLLIN;
+        fds[1].fd = *handoff_sock;
+        fds[1].events = POLLIN;
+        int poll_result = poll(fds, 2, -1);
+        if (poll_result == -1 && errno == EINTR)
+            continue;
+        if (poll_result == -1)
+            return -1;
+
+        if (fds[1].revents & POLLIN) {
+            if (hand_over(handoff_sock, sock, local_sock) == -1)
+                fprintf(stderr, "Handing over has failed\n");
+        }
+        else {
+            break;
+        }
+    }
+
+    return 0;
+}
+
 #define DROP_CONN()                                                            \
     {                                                                          \
         fprintf(stderr, "Connection droped\n");                                \
@@ -303,20 +1392,103 @@ static int init_and_bind(server_input_data *idata) {
 
 int main(int argc, char **argv) {
     server_input_data idata = parse_input(argc, argv);
-    int sock = init_and_bind(&idata);
+    trace_init("netstore-server");
+    CHECK(bufpool_init(idata.hugetlb ? BUFPOOL_HUGETLB : 0));
+
+    // If the saved index is still valid, the directory is not scanned at all.
+    metaindex index;
+    CHECK(metaindex_init(&index));
+    if (idata.index_path && metaindex_load(&index, idata.index_path) == 0) {
+        fprintf(stderr, "Loaded index with %lu entries\n", index.num_entries);
+    }
+
+    refresh_index(&idata, &index, 0);
+    CHECK(idata.root_fd =
+              open(idata.dirname, O_PATH | O_DIRECTORY | O_CLOEXEC));
+
+    // If a server is already running, we take its sockets instead of binding.
+    int sock = -1;
+    int local_sock = -1;
+    if (idata.handoff_path && take_over(idata.handoff_path, &sock, &local_sock))
+        printf("Took over the listening sockets\n");
+    else
+        sock = init_and_bind(&idata);
+
+    if (local_sock == -1 && idata.local_path) {
+        local_sock = init_and_bind_unix(idata.local_path);
+        printf("Accepting local clients on %s\n", idata.local_path);
+    }
+
+    int handoff_sock =
+        (idata.handoff_path ? init_and_bind_unix(idata.handoff_path) : -1);
 
     struct sockaddr_in client_address;
     socklen_t client_address_len;
     for (;;) {
+        // After the handoff, we exit once the last client has been served.
+        if (sock == -1) {
+            fprintf(stderr, "Server has been replaced, exiting\n");
+            break;
+        }
+
         fprintf(stderr, "Server awaits for the next clinet\n");
 
+        // Wait until one of the sockets has a client. Negative fds are ignored.
+        struct pollfd listen_fds[3];
+        listen_fds[0].fd = sock;
+        listen_fds[0].events = POLLIN;
+        listen_fds[1].fd = local_sock;
+        listen_fds[1].events = POLLIN;
+        listen_fds[2].fd = handoff_sock;
+        listen_fds[2].events = POLLIN;
+        int poll_result = poll(listen_fds, 3, -1);
+        if (poll_result == -1 && errno == EINTR)
+            continue;
+        CHECK(poll_result);
+
+        // Clients that are waiting now will be accepted by the new server.
+        if (listen_fds[2].revents & POLLIN) {
+            if (hand_over(&handoff_sock, &sock, &local_sock) == -1)
+                fprintf(stderr, "Handing over has failed\n");
+            continue;
+        }
+
+        int is_local = (local_sock != -1 && (listen_fds[1].revents & POLLIN));
         client_address_len = sizeof(client_address);
         // get client connection from the socket
         int msg_sock;
-        CHECK(msg_sock = accept(sock, (struct sockaddr *)&client_address,
-                                &client_address_len));
+        if (is_local) {
+            CHECK(msg_sock = accept(local_sock, 0, 0));
+        }
+        else {
+            CHECK(msg_sock = accept(sock, (struct sockaddr *)&client_address,
+                                    &client_address_len));
+        }
+
+        trace_connection(msg_sock, 1);
+
+        zerocopy_state zc;
+        memset(&zc, 0, sizeof(zc));
+        if (idata.zerocopy) {
+            int one = 1;
+            zc.enabled = (setsockopt(msg_sock, SOL_SOCKET, SO_ZEROCOPY, &one,
+                                     sizeof(one)) == 0);
+        }
 
         for (;;) {
+            // Chunks sent while the client was reading are released here, so
+            // they don't wait for the next send.
+            if (zc.num_pending > 0 &&
+                reap_zerocopy_completions(msg_sock, &zc,
+                                          ZEROCOPY_MAX_PENDING) == -1) {
+                DROP_CONN();
+            }
+
+            if (wait_for_request(msg_sock, &handoff_sock, &sock,
+                                 &local_sock) == -1) {
+                DROP_CONN();
+            }
+
             uint8 buffer[2];
             int try_rcv_total_result;
             try_rcv_total_result = try_rcv_total(msg_sock, buffer, 2);
@@ -325,29 +1497,101 @@ int main(int argc, char **argv) {
             }
             else if (try_rcv_total_result == 0) {
                 fprintf(stderr, "Client has ended connection\n");
+                if (reap_zerocopy_completions(msg_sock, &zc, 0) == -1)
+                    fprintf(stderr, "Zerocopy sends have not completed\n");
                 CHECK(close(msg_sock));
                 break;
             }
 
             int16 action_type = unaligned_load_int16be(buffer);
+            trace_next_request(msg_sock);
+            TRACE_BEGIN(request_start);
 
             if (action_type == PROT_REQ_FILELIST) {
                 fprintf(stderr, "Received request for a filelist\n");
-                if (snd_filenames(msg_sock, idata.dirname) == -1) {
+                if (snd_filenames(msg_sock, &idata, &index) == -1) {
                     DROP_CONN();
                 }
                 else {
                     fprintf(stderr, "Filenames response has been sent\n");
                 }
             }
-            else if (action_type == PROT_REQ_FILECHUNK) {
+            else if (action_type == PROT_REQ_DIRLIST) {
+                char *path;
+                if (rcv_dirlist_request(msg_sock, &path) == -1) {
+                    DROP_CONN();
+                }
+
+                fprintf(stderr, "Received request for a dirlist of: %s\n",
+                        path);
+                int snd_result = snd_dirlist(msg_sock, &idata, &index, path);
+                free(path);
+                if (snd_result == -1) {
+                    DROP_CONN();
+                }
+                else {
+                    fprintf(stderr, "Dirlist response has been sent\n");
+                }
+            }
+            else if (action_type == PROT_REQ_FILEFD) {
+                // Request has the same format as the dirlist request.
+                char *path;
+                if (rcv_dirlist_request(msg_sock, &path) == -1) {
+                    DROP_CONN();
+                }
+
+                fprintf(stderr, "Received request for a filefd of: %s\n",
+                        path);
+                int snd_result =
+                    snd_filefd(msg_sock, idata.root_fd, path, is_local);
+                free(path);
+                if (snd_result == -1) {
+                    DROP_CONN();
+                }
+                else {
+                    fprintf(stderr, "Filefd response has been sent\n");
+                }
+            }
+            else if (action_type == PROT_REQ_FILEPUT) {
+                fprintf(stderr, "Received request for a fileput\n");
+                chunk_request request;
+                if ((rcv_chunk_request(msg_sock, &request)) == -1) {
+                    DROP_CONN();
+                }
+
+                if (rcv_fileput(msg_sock, &idata, &request) == -1) {
+                    chunk_request_free(&request);
+                    DROP_CONN();
+                }
+                else {
+                    fprintf(stderr, "Fileput response has been sent\n");
+                }
+
+                chunk_request_free(&request);
+            }
+            else if (action_type == PROT_REQ_FILECHUNK ||
+                     action_type == PROT_REQ_FILECHUNK_LZ) {
                 fprintf(stderr, "Received request for a filechunk\n");
                 chunk_request request;
                 if ((rcv_chunk_request(msg_sock, &request)) == -1) {
                     DROP_CONN();
                 }
 
-                if ((snd_filechunk(msg_sock, idata.dirname, &request)) == -1) {
+                int snd_result;
+                if (action_type == PROT_REQ_FILECHUNK_LZ) {
+                    snd_result =
+                        snd_filechunk_lz(msg_sock, idata.root_fd, &request);
+                }
+                else if (zc.enabled) {
+                    snd_result = snd_filechunk_zerocopy(
+                        msg_sock, idata.root_fd, &request, &zc);
+                }
+                else {
+                    snd_result =
+                        snd_filechunk(msg_sock, idata.root_fd, &request);
+                }
+                if (snd_result == -1) {
+                    chunk_request_free(&request);
                     DROP_CONN();
                 }
                 else {
@@ -360,8 +1604,19 @@ int main(int argc, char **argv) {
                 // We are out of contract, so break a conn with rouge client.
                 DROP_CONN_WITH_ROUGE();
             }
+
+            TRACE_END(request_start, "request");
         }
+
+        // Left only if the connection was dropped.
+        drop_zerocopy_chunks(&zc);
+
+        // Events are written once the connection is closed, so that tracing
+        // does not slow the requests down.
+        trace_flush();
     }
 
+    save_index(&idata, &index);
+    metaindex_free(&index);
     return 0;
 }
@@ -0,0 +1,130 @@
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "common.h"
+#include "shard.h"
+
+// 64bit FNV-1a followed by a finalizer, as FNV alone spreads similar keys
+// (like host:port#n) poorly over the ring.
+static uint64 shard_hash(char const *data, size_t len) {
+    uint64 retval = 14695981039346656037ULL;
+    for (size_t i = 0; i != len; ++i) {
+        retval ^= (uint8)data[i];
+        retval *= 1099511628211ULL;
+    }
+
+    retval ^= retval >> 33;
+    retval *= 0xff51afd7ed558ccdULL;
+    retval ^= retval >> 33;
+    return retval;
+}
+
+static int shard_point_cmp(void const *lhs, void const *rhs) {
+    uint64 lhs_hash = ((shard_point const *)lhs)->hash;
+    uint64 rhs_hash = ((shard_point const *)rhs)->hash;
+    return (lhs_hash > rhs_hash) - (lhs_hash < rhs_hash);
+}
+
+int shard_ring_init(shard_ring *self, char const *servers,
+                    char const *fallback_port) {
+    self->servers = 0;
+    self->num_servers = 0;
+    self->points = 0;
+    self->num_points = 0;
+
+    size_t capacity = 1;
+    for (char const *c = servers; *c; ++c)
+        capacity += (*c == ',');
+
+    self->servers = calloc(capacity, sizeof(shard_server));
+    if (!self->servers) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    char const *curr = servers;
+    for (;;) {
+        size_t len = strcspn(curr, ",");
+        char const *colon = memchr(curr, ':', len);
+        size_t host_len = (colon ? (size_t)(colon - curr) : len);
+        if (host_len == 0 || (colon && colon + 1 == curr + len)) {
+            shard_ring_free(self);
+            errno = EINVAL;
+            return -1;
+        }
+
+        shard_server *server = &self->servers[self->num_servers++];
+        server->host = strndup(curr, host_len);
+        server->port = (colon ? strndup(colon + 1, len - host_len - 1)
+                              : strdup(fallback_port));
+        if (!server->host || !server->port) {
+            shard_ring_free(self);
+            errno = ENOMEM;
+            return -1;
+        }
+
+        curr += len;
+        if (*curr == '\0')
+            break;
+        ++curr;
+    }
+
+    self->points = malloc(self->num_servers * SHARD_POINTS_PER_SERVER *
+                          sizeof(shard_point));
+    if (!self->points) {
+        shard_ring_free(self);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (size_t i = 0; i != self->num_servers; ++i) {
+        for (size_t j = 0; j != SHARD_POINTS_PER_SERVER; ++j) {
+            char key[512];
+            int key_len = snprintf(key, sizeof(key), "%s:%s#%lu",
+                                   self->servers[i].host, self->servers[i].port,
+                                   j);
+            if (key_len >= (int)sizeof(key))
+                key_len = sizeof(key) - 1;
+
+            shard_point *point = &self->points[self->num_points++];
+            point->hash = shard_hash(key, key_len);
+            point->server = i;
+        }
+    }
+
+    qsort(self->points, self->num_points, sizeof(shard_point), shard_point_cmp);
+    return 0;
+}
+
+void shard_ring_free(shard_ring *self) {
+    for (size_t i = 0; i != self->num_servers; ++i) {
+        free(self->servers[i].host);
+        free(self->servers[i].port);
+    }
+
+    free(self->servers);
+    free(self->points);
+}
+
+size_t shard_ring_owner(shard_ring const *self, char const *name) {
+    assert(self->num_points > 0);
+    uint64 hash = shard_hash(name, strlen(name));
+
+    // First point with the hash not less than the hash of the name. If there
+    // is none, we wrap around to the first point.
+    size_t lo = 0;
+    size_t hi = self->num_points;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (self->points[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return self->points[lo == self->num_points ? 0 : lo].server;
+}
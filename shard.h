@@ -0,0 +1,44 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+// Consistent hashing ring that assigns files to servers. Every server is put
+// on the ring in SHARD_POINTS_PER_SERVER places (derived only from its address)
+// and a file is owned by the first server point that follows the hash of its
+// name. Adding or removing a server moves only the files between its points
+// and the preceding ones, which is about 1/n of all files.
+
+#include <stddef.h>
+
+#include "common.h"
+
+#define SHARD_POINTS_PER_SERVER (128)
+
+typedef struct {
+    char *host;
+    char *port;
+} shard_server;
+
+typedef struct {
+    uint64 hash;
+    size_t server;
+} shard_point;
+
+typedef struct {
+    shard_server *servers;
+    size_t num_servers;
+    shard_point *points; // Sorted by hash.
+    size_t num_points;
+} shard_ring;
+
+// Parses comma separated list of servers in format <host>[:<port>]. Servers
+// without the port use [fallback_port]. -1 is returned when the list is
+// malformed (errno is set to EINVAL) or malloc failes, otherwise 0.
+int shard_ring_init(shard_ring *self, char const *servers,
+                    char const *fallback_port);
+
+void shard_ring_free(shard_ring *self);
+
+// Returns the index of the server that owns the file with the given name.
+size_t shard_ring_owner(shard_ring const *self, char const *name);
+
+#endif // SHARD_H
@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "trace.h"
+
+// Events are written in blocks of at most that many bytes. Every write holds
+// whole events, so the client and the server can append to the same file.
+#define TRACE_BUFFER_SIZE (64 * 1024)
+#define TRACE_MAX_EVENT_SIZE (512)
+
+int trace_enabled = 0;
+
+static int trace_fd = -1;
+static pid_t trace_pid;
+static char trace_buffer[TRACE_BUFFER_SIZE];
+static size_t trace_buffer_size = 0;
+
+// Requests sent or received so far on every connection, indexed by socket.
+static trace_request *trace_conns = 0;
+static size_t trace_conns_capacity = 0;
+
+static trace_request trace_current;
+
+// Appends [len] bytes of the event to the buffer, flushing it first if the
+// event does not fit.
+static void trace_append(char const *event, size_t len) {
+    if (trace_buffer_size + len > TRACE_BUFFER_SIZE)
+        trace_flush();
+
+    memcpy(trace_buffer + trace_buffer_size, event, len);
+    trace_buffer_size += len;
+}
+
+void trace_init(char const *process_name) {
+#ifdef NO_TRACE
+    (void)process_name;
+#else
+    char const *path = getenv("NETSTORE_TRACE");
+    if (!path || path[0] == '\0')
+        return;
+
+    // Whoever creates the file starts the JSON array. It is never closed,
+    // which the trace viewers accept, so that more events can be appended.
+    int created = 1;
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC,
+                    0666);
+    if (trace_fd == -1 && errno == EEXIST) {
+        created = 0;
+        trace_fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    }
+
+    if (trace_fd == -1) {
+        fprintf(stderr, "WARNING: Could not open trace file %s: %s\n", path,
+                strerror(errno));
+        return;
+    }
+
+    trace_enabled = 1;
+    trace_pid = getpid();
+    trace_current.conn = 0;
+    trace_current.seq = TRACE_NO_SEQ;
+    if (created)
+        trace_append("[\n", 2);
+
+    char event[TRACE_MAX_EVENT_SIZE];
+    int len = snprintf(event, sizeof(event),
+                       "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                       "\"args\":{\"name\":\"%s\"}},\n",
+                       (int)trace_pid, process_name);
+    trace_append(event, len);
+    atexit(trace_flush);
+#endif
+}
+
+void trace_connection(int sock, int is_server) {
+    if (!TRACE_ENABLED || sock < 0)
+        return;
+
+    if ((size_t)sock >= trace_conns_capacity) {
+        size_t new_capacity =
+            (trace_conns_capacity ? trace_conns_capacity : 16);
+        while (new_capacity <= (size_t)sock)
+            new_capacity *= 2;
+
+        trace_request *new_conns =
+            realloc(trace_conns, new_capacity * sizeof(trace_request));
+        if (!new_conns) {
+            errno = ENOMEM;
+            FAILWITH_ERRNO();
+        }
+
+        trace_conns = new_conns;
+        trace_conns_capacity = new_capacity;
+    }
+
+    // Port of the client is the local one on the client side.
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    int name_result;
+    if (is_server)
+        name_result = getpeername(sock, (struct sockaddr *)&address,
+                                  &address_len);
+    else
+        name_result = getsockname(sock, (struct sockaddr *)&address,
+                                  &address_len);
+
+    trace_request *conn = &trace_conns[sock];
+    conn->conn = 0;
+    conn->seq = 0;
+    if (name_result == 0 && address.ss_family == AF_INET)
+        conn->conn = ntohs(((struct sockaddr_in *)&address)->sin_port);
+
+    trace_current.conn = conn->conn;
+    trace_current.seq = TRACE_NO_SEQ;
+}
+
+trace_request trace_next_request(int sock) {
+    if (TRACE_ENABLED && sock >= 0 && (size_t)sock < trace_conns_capacity) {
+        trace_current = trace_conns[sock];
+        ++trace_conns[sock].seq;
+    }
+
+    return trace_current;
+}
+
+void trace_set_request(trace_request request) {
+    trace_current = request;
+}
+
+uint64 trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void trace_phase(char const *phase, uint64 start) {
+    if (TRACE_ENABLED)
+        trace_phase_at(phase, start, trace_now());
+}
+
+void trace_phase_at(char const *phase, uint64 start, uint64 end) {
+    if (!TRACE_ENABLED)
+        return;
+
+    char event[TRACE_MAX_EVENT_SIZE];
+    int len;
+
+    // Chrome trace timestamps are in microseconds.
+    if (trace_current.seq == TRACE_NO_SEQ) {
+        len = snprintf(event, sizeof(event),
+                       "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                       "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"conn\":%u}},\n",
+                       phase, (int)trace_pid, trace_current.conn,
+                       start / 1000.0, (end - start) / 1000.0,
+                       trace_current.conn);
+    }
+    else {
+        len = snprintf(event, sizeof(event),
+                       "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,"
+                       "\"ts\":%.3f,\"dur\":%.3f,"
+                       "\"args\":{\"conn\":%u,\"seq\":%u}},\n",
+                       phase, (int)trace_pid, trace_current.conn,
+                       start / 1000.0, (end - start) / 1000.0,
+                       trace_current.conn, trace_current.seq);
+    }
+
+    if (len > 0 && (size_t)len < sizeof(event))
+        trace_append(event, len);
+}
+
+void trace_flush(void) {
+    if (!TRACE_ENABLED || trace_buffer_size == 0)
+        return;
+
+    // Single write, so events of other processes end up between the blocks.
+    ssize_t written = write(trace_fd, trace_buffer, trace_buffer_size);
+    if (written != (ssize_t)trace_buffer_size) {
+        fprintf(stderr, "WARNING: Could not write the trace, tracing is off\n");
+        trace_enabled = 0;
+    }
+
+    trace_buffer_size = 0;
+}
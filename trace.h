@@ -0,0 +1,79 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Tracing of the phases of every request, in both programs. When the
+// NETSTORE_TRACE environment variable names a file, every traced phase is
+// appended there as a Chrome trace event, so the file can be opened in
+// chrome://tracing or Perfetto. Timestamps come from the monotonic clock, so
+// the client and the server started on the same machine share the timeline.
+//
+// Request has the same id on both sides without any change in the protocol: it
+// is the TCP port of the client and the number of the request on the
+// connection. Every program is a separate process in the trace, and events of
+// a connection are put in its row with that port as the thread id, so the two
+// sides of a request are in matching rows of the two process tracks.
+//
+// When tracing is off, phases cost a single branch. With NO_TRACE defined they
+// are compiled out completely.
+
+#include <stddef.h>
+
+#include "common.h"
+
+// Sequence number of the events that belong to the connection, not to any of
+// its requests (like connect).
+#define TRACE_NO_SEQ (UINT32_MAX)
+
+typedef struct {
+    uint16 conn; // Client side port of the connection, 0 if it is not TCP.
+    uint32 seq;  // Number of the request on the connection, from 0.
+} trace_request;
+
+#ifdef NO_TRACE
+#define TRACE_ENABLED (0)
+#else
+extern int trace_enabled;
+#define TRACE_ENABLED (trace_enabled)
+#endif
+
+// Marks the start of the phase, [VAR] is the name of the variable holding the
+// timestamp.
+#define TRACE_BEGIN(VAR) uint64 VAR = (TRACE_ENABLED ? trace_now() : 0)
+
+// Emits the phase started with TRACE_BEGIN as a part of the current request.
+#define TRACE_END(VAR, PHASE)                                                  \
+    do {                                                                       \
+        if (TRACE_ENABLED)                                                     \
+            trace_phase((PHASE), (VAR));                                       \
+    } while (0)
+
+// Opens the trace file if NETSTORE_TRACE is set. Failing to open it only
+// prints a warning and leaves tracing off.
+void trace_init(char const *process_name);
+
+// Starts numbering requests of the new connection [sock] from 0. [is_server]
+// tells which end of the connection is the client. Connection becomes the
+// current one, with no current request.
+void trace_connection(int sock, int is_server);
+
+// Takes the id of the next request sent or received on [sock] and makes it the
+// current request.
+trace_request trace_next_request(int sock);
+
+// Makes [request] the current request. Used when responses come in a
+// different order than the requests are sent.
+void trace_set_request(trace_request request);
+
+// Current time of the monotonic clock in nanoseconds.
+uint64 trace_now(void);
+
+// Emits the [phase] of the current request that has started at [start].
+void trace_phase(char const *phase, uint64 start);
+
+// Same as trace_phase, but for the phase that has already ended at [end].
+void trace_phase_at(char const *phase, uint64 start, uint64 end);
+
+// Writes buffered events to the file. Called at exit as well.
+void trace_flush(void);
+
+#endif // TRACE_H